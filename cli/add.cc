@@ -37,11 +37,11 @@
 void add(QString path)
 {
 	int64_t rev;
-	doozer::Error* err = conn->Set(path.toStdString(), 0, &rev, "", 0);
+	doozer::Status st = conn->Set(path.toStdString(), 0, &rev, "", 0);
 
-	if (err)
+	if (!st.Ok())
 	{
-		std::cerr << err->ToString() << std::endl;
+		std::cerr << st.ToString() << std::endl;
 		return;
 	}
 
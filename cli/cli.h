@@ -42,6 +42,6 @@ void set(QString path, int64_t rev, QByteArray contents);
 void stat(QString path);
 void touch(QString path);
 void wait(QString glob);
-void watch(QString glob);
+void watch(QVector<QString> globs);
 
 #endif /* DOOZER_CLI_CLI_H */
@@ -36,10 +36,10 @@
 
 void del(QString path, int64_t rev)
 {
-	doozer::Error* err = conn->Del(path, rev);
-	if (err)
+	doozer::Status st = conn->Del(path, rev);
+	if (!st.Ok())
 	{
-		std::cerr << err->ToString() << std::endl;
+		std::cerr << st.ToString() << std::endl;
 		return;
 	}
 }
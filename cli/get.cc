@@ -38,11 +38,11 @@ void get(QString path)
 {
 	int64_t rev;
 	QByteArray buf;
-	doozer::Error* err = conn->Get(path, 0, &buf, &rev);
+	doozer::Status st = conn->Get(path, 0, &buf, &rev);
 
-	if (err)
+	if (!st.Ok())
 	{
-		std::cerr << err->ToString() << std::endl;
+		std::cerr << st.ToString() << std::endl;
 		return;
 	}
 
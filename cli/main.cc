@@ -28,6 +28,7 @@
  */
 
 #include <QtCore/QString>
+#include <QtCore/QVector>
 #include <vector>
 #include "doozer.h"
 #include <iostream>
@@ -51,12 +52,19 @@ void usage()
 
 int main(int argc, char** argv)
 {
-	conn = new doozer::Conn();
+	if (argc < 2)
+		usage();
+
+	// Commands connect when they first talk to the server, so bad
+	// arguments are reported without waiting for the network.
+	conn = new doozer::Conn(doozer::CONNECT_LAZY);
 
+	// Not connected yet, so this only catches a malformed URI; failing to
+	// connect is reported by the command.
 	if (!conn->IsValid())
 	{
-		doozer::Error* err = conn->GetError();
-		std::cerr << err->ToString() << std::endl;
+		doozer::Status st = conn->GetStatus();
+		std::cerr << st.ToString() << std::endl;
 		return 1;
 	}
 
@@ -111,8 +119,12 @@ int main(int argc, char** argv)
 	}
 	else if (!strcmp(argv[1], "watch") && argc >= 3)
 	{
-		QString glob(argv[2]);
-		watch(glob);
+		QVector<QString> globs;
+
+		for (int i = 2; i < argc; i++)
+			globs.append(QString(argv[i]));
+
+		watch(globs);
 	}
 	else
 		usage();
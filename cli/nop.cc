@@ -36,10 +36,10 @@
 
 void nop()
 {
-	doozer::Error* err = conn->Nop();
-	if (err)
+	doozer::Status st = conn->Nop();
+	if (!st.Ok())
 	{
-		std::cerr << err->ToString() << std::endl;
+		std::cerr << st.ToString() << std::endl;
 		return;
 	}
 }
@@ -40,29 +40,27 @@
 #include "doozer.h"
 
 using doozer::Conn;
-using doozer::Error;
+using doozer::Status;
 
 int main(int argc, char** argv)
 {
 	// Get default parameters from the environment.
 	QScopedPointer<Conn> c(new Conn());
-	Error* err;
+	Status st;
 
 	if (!c->IsValid())
 	{
-		err = c->GetError();
+		st = c->GetStatus();
 		std::cerr << "Unable to connect to Doozer: "
-			<< err->ToString() << std::endl;
-		delete err;
+			<< st.ToString() << std::endl;
 		return 1;
 	}
 
-	err = c->Nop();
-	if (err)
+	st = c->Nop();
+	if (!st.Ok())
 	{
 		std::cerr << "Unable to connect to Doozer: "
-			<< err->ToString() << std::endl;
-		delete err;
+			<< st.ToString() << std::endl;
 		return 1;
 	}
 	else
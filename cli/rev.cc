@@ -37,11 +37,11 @@
 void rev(QString path)
 {
 	int64_t rev;
-	doozer::Error* err = conn->Rev(&rev);
+	doozer::Status st = conn->Rev(&rev);
 
-	if (err)
+	if (!st.Ok())
 	{
-		std::cerr << err->ToString() << std::endl;
+		std::cerr << st.ToString() << std::endl;
 		return;
 	}
 	std::cout << rev << std::endl;
@@ -37,11 +37,11 @@
 void set(QString path, int64_t rev, QByteArray contents)
 {
 	int64_t newrev;
-	doozer::Error* err = conn->Set(path, rev, &newrev, contents);
+	doozer::Status st = conn->Set(path, rev, &newrev, contents);
 
-	if (err)
+	if (!st.Ok())
 	{
-		std::cerr << err->ToString() << std::endl;
+		std::cerr << st.ToString() << std::endl;
 		return;
 	}
 
@@ -38,11 +38,11 @@ void stat(QString path)
 {
 	int64_t rev;
 	int len;
-	doozer::Error* err = conn->Stat(path, 0, &len, &rev);
+	doozer::Status st = conn->Stat(path, 0, &len, &rev);
 
-	if (err)
+	if (!st.Ok())
 	{
-		std::cerr << err->ToString() << std::endl;
+		std::cerr << st.ToString() << std::endl;
 		return;
 	}
 	std::cout << rev << " " << len << std::endl;
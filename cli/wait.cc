@@ -38,17 +38,17 @@ void wait(QString glob)
 {
 	doozer::Event ev;
 	int64_t rev;
-	doozer::Error* err = conn->Rev(&rev);
-	if (err)
+	doozer::Status st = conn->Rev(&rev);
+	if (!st.Ok())
 	{
-		std::cerr << err->ToString() << std::endl;
+		std::cerr << st.ToString() << std::endl;
 		return;
 	}
 
-	err = conn->Wait(glob, rev, &ev);
-	if (err)
+	st = conn->Wait(glob, rev, &ev);
+	if (!st.Ok())
 	{
-		std::cerr << err->ToString() << std::endl;
+		std::cerr << st.ToString() << std::endl;
 		return;
 	}
 
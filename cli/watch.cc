@@ -28,38 +28,50 @@
  */
 
 #include <QtCore/QString>
+#include <QtCore/QVector>
 #include <vector>
 #include "doozer.h"
 #include <iostream>
 
 #include "cli/cli.h"
 
-void watch(QString glob)
+void watch(QVector<QString> globs)
 {
-	doozer::Event ev;
+	doozer::Watcher watcher(conn);
 	int64_t rev;
-	doozer::Error* err = conn->Rev(&rev);
-	if (err)
+	doozer::Status st = conn->Rev(&rev);
+	if (!st.Ok())
 	{
-		std::cerr << err->ToString() << std::endl;
+		std::cerr << st.ToString() << std::endl;
 		return;
 	}
 
-	// We don't want to be interrupted while waiting.
-	conn->SetTimeout(-1);
-
-	for (;;)
+	// All globs are watched over the one connection, with a few
+	// revisions in flight for each so busy globs don't fall behind.
+	for (QString glob : globs)
 	{
-		err = conn->Wait(glob, rev, &ev);
+		st = watcher.SubscribeStream(glob, rev, 16,
+				[](doozer::Status st,
+					std::vector<doozer::Event>* evs) {
+			if (!st.Ok())
+			{
+				std::cerr << st.ToString() << std::endl;
+				return;
+			}
+			for (doozer::Event& ev : *evs)
+				std::cout << ev.Path() << " " << ev.Rev()
+					<< " set " << ev.QBody().length()
+					<< std::endl << ev.Body() << std::endl;
+		}, 0);
 
-		if (err)
+		if (!st.Ok())
 		{
-			std::cerr << err->ToString() << std::endl;
+			std::cerr << st.ToString() << std::endl;
 			return;
 		}
-		std::cout << ev.Path() << " " << ev.Rev() << " set "
-			<< ev.QBody().length() << std::endl
-			<< ev.Body() << std::endl;
-		rev = ev.Rev() + 1;
 	}
+
+	st = watcher.Run();
+	if (!st.Ok())
+		std::cerr << st.ToString() << std::endl;
 }
@@ -30,19 +30,24 @@
 #ifndef DOOZER_DOOZER_H
 #define DOOZER_DOOZER_H 1
 
-#define	DOOZER_URI_PREFIX	"doozer:?"
-
-struct QTcpSocket;
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <thread>
 
-namespace google {
-namespace protobuf {
-class Message;
-}  // namespace protobuf
-}  // namespace google
+#define	DOOZER_URI_PREFIX	"doozer:?"
 
 namespace doozer {
 
+class Request;
+class Response;
 class Transaction;
+class Transport;
 
 const QString doozer_uri_prefix = QString(DOOZER_URI_PREFIX);
 
@@ -64,6 +69,68 @@ protected:
 	QString message_;
 };
 
+// Outcome of a Doozer operation. A status is a small value which can be
+// passed around by value; its message is only put together when asked for.
+class Status {
+public:
+	// Error codes reported by the server, as in msg.proto. The negative
+	// ones are for errors which didn't come from the server: TIMEOUT if
+	// no response arrived in time or the connection didn't come up in
+	// time, LOCAL for everything else.
+	enum Code {
+		TIMEOUT      = -3,
+		LOCAL        = -1,
+		OK           = 0,
+		TAG_IN_USE   = 1,
+		UNKNOWN_VERB = 2,
+		READONLY     = 3,
+		TOO_LATE     = 4,
+		REV_MISMATCH = 5,
+		BAD_PATH     = 6,
+		MISSING_ARG  = 7,
+		RANGE        = 8,
+		NOTDIR       = 20,
+		ISDIR        = 21,
+		NOENT        = 22,
+		OTHER        = 127,
+	};
+
+	// Constructs a successful status.
+	Status();
+
+	// Constructs a status for the server error "code", with an optional
+	// "detail" message.
+	Status(Code code, std::string detail = std::string());
+
+	// Constructs a status for an error which occurred on the client side,
+	// described by "message".
+	explicit Status(QString message);
+
+	// Constructs the status reported by the server in "res". The error
+	// detail is moved out of "res".
+	explicit Status(Response* res);
+
+	// Whether the operation succeeded.
+	bool Ok() const;
+
+	// The error code, OK on success.
+	Code ErrorCode() const;
+
+	// Returns a string describing the error which ocurred.
+	std::string ToString() const;
+
+	// Same, but returns a Qt compatible string.
+	QString ToQString() const;
+
+	// Compatibility with the Error* interface: 0 on success, otherwise a
+	// newly allocated Error owned by the caller, who has to delete it.
+	Error* ToError() const;
+
+private:
+	Code code_;
+	std::string detail_;
+};
+
 // Informatiou about a specific file in the Doozer tree.
 class FileInfo {
 public:
@@ -72,8 +139,9 @@ public:
 	virtual ~FileInfo();
 
 	// Retrieve the name contained in the fileinfo object.
-	std::string Name();
+	const std::string& Name();
 	QString QName();
+	void Name(std::string newname);
 	void QName(QString newname);
 
 	// Length of the file, if appropriate.
@@ -93,7 +161,7 @@ public:
 	void IsDir(bool newdir);
 
 protected:
-	QString name_;
+	std::string name_;
 	int len_;
 	int64_t rev_;
 	bool isset_;
@@ -112,12 +180,14 @@ public:
 
 	// Path of the modified file.
 	QString QPath();
-	std::string Path();
+	const std::string& Path();
+	void Path(std::string newpath);
 	void QPath(QString newpath);
 
 	// Contents the file was set to.
 	QByteArray QBody();
-	std::string Body();
+	const std::string& Body();
+	void Body(std::string newbody);
 	void QBody(QByteArray newbody);
 
 	// Flags.
@@ -126,20 +196,73 @@ public:
 
 private:
 	int64_t rev_;
-	QString path_;
-	QByteArray body_;
+	std::string path_;
+	std::string body_;
 	uint32_t flags_;
 };
 
+// Called by Conn::Walk() for every file visited, with the file's path,
+// revision and contents in "ev". Returning false ends the walk.
+typedef std::function<bool (Event* ev)> WalkFunc;
+
+// Callbacks receiving the results of the asynchronous operations of Conn.
+typedef std::function<void (Status st)> DoneFunc;
+typedef std::function<void (Status st, int64_t rev)> RevFunc;
+typedef std::function<void (Status st, const std::string& body,
+		int64_t rev)> GetFunc;
+typedef std::function<void (Status st, int len, int64_t rev)> StatFunc;
+typedef std::function<void (Status st,
+		const std::vector<std::string>& names)> GetdirFunc;
+typedef std::function<void (Status st, Event* ev)> EventFunc;
+typedef std::function<void (Status st, std::vector<Event>* evs)> EventsFunc;
+
+// Socket implementations connections can use.
+enum TransportKind {
+	// As configured with --with-transport, unless the DOOZER_TRANSPORT
+	// environment variable names another one ("qt" or "posix").
+	TRANSPORT_DEFAULT,
+	// QTcpSocket. Unless the library was configured with
+	// --with-transport=qt, POSIX sockets are used instead.
+	TRANSPORT_QT,
+	// Non-blocking POSIX sockets with TCP_NODELAY set.
+	TRANSPORT_POSIX,
+};
+
+// Selects the socket implementation of connections made from now on.
+// "sndbuf" and "rcvbuf" set the kernel buffer sizes of POSIX sockets; 0
+// keeps the system defaults.
+void SetTransport(TransportKind kind, int sndbuf = 0, int rcvbuf = 0);
+
+// When a connection is established.
+enum ConnectMode {
+	// Right away, in the constructor.
+	CONNECT_NOW,
+	// When the first request is sent, or when asked to by Prewarm().
+	CONNECT_LAZY,
+};
+
 // Doozer connection type.
+//
+// The operations used to return a newly allocated Error*, and since
+// version 1.0 return a Status. This changes the signatures of the virtual
+// methods, so code built against the old interface, including subclasses
+// overriding them, has to be rebuilt and adapted; Status::ToError() gives
+// the old result.
 class Conn {
 public:
-	// Various methods of connecting.
+	// Various methods of connecting. Without a URI, the DOOZER_URI and
+	// DOOZER_BOOT_URI environment variables are used. All cluster
+	// members are connected to at the same time, and the first one to
+	// answer and let us in is used. Host names in the URI are looked up
+	// one at a time first, which blocks; use numeric addresses where
+	// connecting quickly matters.
 	Conn();
+	explicit Conn(ConnectMode mode);
 	Conn(std::string addr);
-	Conn(std::string uri, std::string boot_uri);
+	Conn(std::string uri, std::string boot_uri,
+			ConnectMode mode = CONNECT_NOW);
 	Conn(QString addr);
-	Conn(QString uri, QString boot_uri);
+	Conn(QString uri, QString boot_uri, ConnectMode mode = CONNECT_NOW);
 
 	// Disconnect and dispose of the connection.
 	virtual ~Conn();
@@ -149,94 +272,863 @@ public:
 	// indefinitely for updates).
 	virtual void SetTimeout(int timeout);
 
-	// Whether or not the connection was established successfully.
+	// Sets the number of requests which are kept in flight at the same
+	// time by operations made up of many requests, such as Getdir. A
+	// "window" of 1 waits for every response before sending the next
+	// request.
+	virtual void SetWindow(int window);
+
+	// Whether or not the connection was established successfully. For
+	// connections made with CONNECT_LAZY, this only means nothing has
+	// gone wrong yet: they are valid from the start if the URI can be
+	// parsed, and until connecting fails.
 	virtual bool IsValid();
 
-	// The error which ocurred when establishing the connection
+	// Whether the connection to a cluster member is up right now, which
+	// a CONNECT_LAZY connection isn't before its first request.
+	virtual bool IsConnected();
+
+	// Starts connecting a CONNECT_LAZY connection without waiting for
+	// the connection to come up, so the first request finds it ready.
+	// Cluster names are looked up in the boot cluster right away.
+	virtual void Prewarm();
+
+	// The error which ocurred when establishing the connection. The
+	// returned Error is owned by the caller.
 	virtual Error* GetError();
 
+	// Same, as a Status.
+	virtual Status GetStatus();
+
 	// Attempts to gain access using the given "token".
-	virtual Error* Access(std::string token);
-	virtual Error* Access(QString token);
+	virtual Status Access(std::string token);
+	virtual Status Access(QString token);
 
 	// Set the contents of "file". This operation is atomic, so you have
 	// to set the whole "body" at a time. "oldRev" must be set to the
 	// current revision of the file, and "newRev" will be set to the
 	// revision number created by the mutation.
-	virtual Error* Set(std::string file, int64_t oldRev, int64_t* newRev,
+	virtual Status Set(std::string file, int64_t oldRev, int64_t* newRev,
 			const char *body, size_t len);
-	virtual Error* Set(QString file, int64_t oldRev, int64_t* newRev,
+	virtual Status Set(QString file, int64_t oldRev, int64_t* newRev,
 			QByteArray body);
 
 	// Delete the given "file" at the given revision "rev".
-	virtual Error* Del(std::string file, int64_t rev);
-	virtual Error* Del(QString file, int64_t rev);
+	virtual Status Del(std::string file, int64_t rev);
+	virtual Status Del(QString file, int64_t rev);
 
 	// Does absolutely nothing, but this can be used to check the server
 	// connectivity.
-	virtual Error* Nop();
+	virtual Status Nop();
 
 	// Gets the content of the given "file" at revision "storerev".
 	// Stores the contents into "buf" and the revision into "filerev".
-	// If "rev" is NULL, the latest revision will be returned.
-	virtual Error* Get(std::string file, int64_t* storerev,
+	// If "rev" is NULL, the latest revision will be returned. The
+	// std::string variant swaps the contents into "buf" as they were
+	// decoded from the connection, without copying them again, so it is
+	// the one to use for large files. The QByteArray one copies them.
+	virtual Status Get(std::string file, int64_t* storerev,
 			std::string* buf, int64_t* filerev);
-	virtual Error* Get(QString file, int64_t* storerev, QByteArray* buf,
+	virtual Status Get(QString file, int64_t* storerev, QByteArray* buf,
 			int64_t* filerev);
 
 	// Returns stats about the given "path" at or before version
 	// "storerev". If "storerev" is NULL, returns the latest version.
 	// Stores the result into "len" and "filerev".
-	virtual Error* Stat(std::string path, int64_t* storerev,
+	virtual Status Stat(std::string path, int64_t* storerev,
 			int* len, int64_t* filerev);
-	virtual Error* Stat(QString path, int64_t* storerev,
+	virtual Status Stat(QString path, int64_t* storerev,
 			int* len, int64_t* filerev);
 
 	// Returns the current revision of the store in "rev".
-	virtual Error* Rev(int64_t* rev);
+	virtual Status Rev(int64_t* rev);
 
 	// Read up to "lim" names from "dir", at revision "rev", into vector
 	// "names". Names are read in lexicographical order, starting at
 	// position "off". A negative "lim" means to read until the end.  "rev"
 	// should be obtained from the Rev() method, since directories have
-	// their own magic revision ID.
-	virtual Error* Getdir(std::string dir, int64_t rev, int32_t off,
+	// their own magic revision ID. Up to the configured window of entries
+	// are requested at a time.
+	virtual Status Getdir(std::string dir, int64_t rev, int32_t off,
 			int lim, std::vector<std::string>* names);
-	virtual Error* Getdir(QString dir, int64_t rev, int32_t off, int lim,
+	virtual Status Getdir(QString dir, int64_t rev, int32_t off, int lim,
 			QVector<QString>* names);
 
 	// Returns metadata about the file or directory at "path", in revision
 	// "rev". The result is written to "info".
-	virtual Error* Statinfo(int64_t rev, std::string path, FileInfo** info);
-	virtual Error* Statinfo(int64_t rev, QString path, FileInfo** info);
+	virtual Status Statinfo(int64_t rev, std::string path, FileInfo** info);
+	virtual Status Statinfo(int64_t rev, QString path, FileInfo** info);
 
 	// Retrieves information about the next "lim" directory entries of
 	// "dir", starting at "off" revision "rev" and placing the result
-	// into "info".
-	virtual Error* Getdirinfo(QString dir, int64_t rev, int32_t off,
+	// into "info". The entries are stat'ed concurrently, up to the
+	// configured window at a time.
+	virtual Status Getdirinfo(QString dir, int64_t rev, int32_t off,
 			int lim, QVector<FileInfo>* info);
-	virtual Error* Getdirinfo(std::string dir, int64_t rev, int32_t off,
+	virtual Status Getdirinfo(std::string dir, int64_t rev, int32_t off,
 			int lim, std::vector<FileInfo>* info);
 
+	// Visits up to "lim" files matching "glob" at revision "rev", in
+	// lexicographical order starting with the "off"th match, and calls
+	// "fn" for each of them as they come in. A negative "lim" visits all
+	// matching files. Up to the configured window of files are requested
+	// at a time.
+	virtual Status Walk(QString glob, int64_t rev, int32_t off, int lim,
+			WalkFunc fn);
+	virtual Status Walk(std::string glob, int64_t rev, int32_t off,
+			int lim, WalkFunc fn);
+
 	// Waits for modification events of the expression given as "glob",
 	// after revision "rev" and stores the event in "ev".
-	virtual Error* Wait(QString glob, int64_t rev, Event* ev);
-	virtual Error* Wait(std::string glob, int64_t rev, Event* ev);
+	virtual Status Wait(QString glob, int64_t rev, Event* ev);
+	virtual Status Wait(std::string glob, int64_t rev, Event* ev);
+
+	// Asynchronous variants of the operations above. These never wait for
+	// the server: the request is handed to the socket, and whatever it
+	// doesn't take right away is sent by Poll() or ProcessIO(), or before
+	// waiting for the response to any request. On a CONNECT_LAZY
+	// connection, the first of them only starts connecting; the requests
+	// go out once the connection is up. Cluster names are still looked up
+	// in the boot cluster first. "cb" is called with the result once the
+	// response has been read, either by Poll() or Flush() or while waiting
+	// for the response to any other request on this connection. An error
+	// is only returned if the request couldn't be sent, in which case "cb"
+	// won't be called.
+	virtual Status SetAsync(std::string file, int64_t oldRev,
+			const char *body, size_t len, RevFunc cb);
+	virtual Status SetAsync(QString file, int64_t oldRev, QByteArray body,
+			RevFunc cb);
+	virtual Status DelAsync(std::string file, int64_t rev, DoneFunc cb);
+	virtual Status DelAsync(QString file, int64_t rev, DoneFunc cb);
+	virtual Status GetAsync(std::string file, int64_t* storerev,
+			GetFunc cb);
+	virtual Status GetAsync(QString file, int64_t* storerev, GetFunc cb);
+	virtual Status StatAsync(std::string path, int64_t* storerev,
+			StatFunc cb);
+	virtual Status StatAsync(QString path, int64_t* storerev, StatFunc cb);
+	virtual Status RevAsync(RevFunc cb);
+	virtual Status NopAsync(DoneFunc cb);
+	virtual Status GetdirAsync(std::string dir, int64_t rev, int32_t off,
+			int lim, GetdirFunc cb);
+	virtual Status GetdirAsync(QString dir, int64_t rev, int32_t off,
+			int lim, GetdirFunc cb);
+	virtual Status WaitAsync(std::string glob, int64_t rev, EventFunc cb);
+	virtual Status WaitAsync(QString glob, int64_t rev, EventFunc cb);
+
+	// Same, but stores the tag the WAIT was sent under into "tag", so it
+	// can be cancelled.
+	virtual Status WaitAsync(std::string glob, int64_t rev, EventFunc cb,
+			int32_t* tag);
+
+	// Gives up on the asynchronous request sent under "tag": its callback
+	// won't be called, and the response is dropped once it arrives.
+	virtual void Cancel(int32_t tag);
+
+	// Runs the callbacks of asynchronous requests whose responses have
+	// arrived, waiting up to "timeout" milliseconds for the first one if
+	// there are none yet.
+	virtual Status Poll(int timeout);
+
+	// Waits until the callbacks of all outstanding asynchronous requests
+	// have been run.
+	virtual Status Flush();
+
+	// Hooks for driving the connection from an application's own event
+	// loop instead of Poll(). Descriptor() returns the socket to watch, or
+	// -1 if there is no connection, and Interest() the poll() events to
+	// watch it for: POLLIN while callbacks are waiting for responses and
+	// POLLOUT while requests are waiting to be sent or the connection is
+	// still coming up. Once the socket is ready, ProcessIO() connects,
+	// sends and reads what it can without blocking and runs the callbacks
+	// of all responses which have arrived completely. While connecting to
+	// several cluster members, only one of their sockets is returned, and
+	// the descriptor changes once the connection is up, so it has to be
+	// checked again after every ProcessIO(). Watchers and caches on the
+	// connection are driven by their Poll(0).
+	virtual int Descriptor();
+	virtual int Interest();
+	virtual Status ProcessIO();
+
+	// Drops the connection and connects to the cluster again, trying the
+	// other addresses from the URI before the one which was in use. The
+	// callbacks of outstanding asynchronous requests are called with an
+	// error. Must not be called from within such a callback.
+	virtual Status Reconnect();
+
+	// Same, but without waiting for the new connection: all addresses are
+	// dialed at once, and the connection comes up in the background like
+	// a CONNECT_LAZY one, driven by Poll() or ProcessIO(). Requests sent
+	// meanwhile go out once it's up.
+	virtual void ReconnectAsync();
 
 	// TODO(caoimhe): Port the more complex functions.
 
 private:
-	void init(QString uri, QString buri);
-	Error* send(const ::google::protobuf::Message& msg);
-	Error* recv(::google::protobuf::Message* msg);
+	void init(QString uri, QString buri, ConnectMode mode);
+
+	// Looks up the cluster members if necessary and connects to one of
+	// them, unless that has already been attempted.
+	Status establish();
+
+	// Fills in "addrs_" from the cluster name, if it is still empty.
+	Status resolve();
+
+	// Looks up the addresses of the members of the cluster "name" in the
+	// boot cluster at "buri" and stores them into "addrs". Unless "fresh"
+	// is set, addresses which were looked up recently are used instead,
+	// in which case "cached" is set.
+	Status lookup(QString name, QString buri, bool fresh,
+			QVector<QString>* addrs, bool* cached);
+
+	// Returns the indices of all cluster addresses, starting with a
+	// random one.
+	std::vector<int> members();
+
+	// Starts connecting to all cluster addresses listed in "which" at the
+	// same time, keeps the connection which is established first and
+	// authenticates, if required, moving on to the next one if that
+	// fails. The previous connection is dropped. Either transport looks
+	// up host names one after the other, blocking, so only addresses
+	// given as numbers are really dialed in parallel.
+	Status dial(const std::vector<int>& which);
+
+	// The two halves of dial(): startDial() only initiates the
+	// connections, finishDial() waits for the first one to come up.
+	void startDial(const std::vector<int>& which);
+	Status finishDial();
+
+	// Like finishDial(), but gives up after "timeout" milliseconds if no
+	// connection has come up yet. Authentication doesn't wait for the
+	// server; the queued requests are sent once it has let us in.
+	Status progressDial(int timeout);
+
+	// Checks the connections started by startDial() without blocking and
+	// returns the index into "dialing_" of one which is up, or -1. Those
+	// which failed are dropped, with the error stored into "st". The
+	// sockets still connecting are added to "fds", if given.
+	int checkDial(Status* st, std::vector<int>* fds);
+
+	// Waits up to "timeout" milliseconds for one of "fds" to finish
+	// connecting. Returns false, with "st" set, if connecting has taken
+	// longer than the timeout of the operations.
+	bool awaitDial(std::vector<int>* fds, int timeout, Status* st);
+
+	// Makes the connection at index "i" of "dialing_" the one requests are
+	// sent over. The others are kept until it has let us in.
+	void adopt(int i);
+
+	// Drops the adopted connection after it didn't let us in.
+	void reject();
+
+	// Drops the connections started by startDial() which are left.
+	void abortDial();
+
+	// Finishes connecting once we've been let in, sending the queued
+	// requests.
+	Status admitted();
+
+	// Sends the requests from "queued_".
+	Status sendQueued();
+
+	// Drops the connection after a write failed, which may have left part
+	// of a request on the stream.
+	Status hangup();
+
+	typedef std::map<int32_t, std::function<void (Response*)> >
+		CallbackMap;
+
+	// Forgets about all requests sent over the connection and moves the
+	// callbacks of the asynchronous ones to "callbacks". Requests which
+	// are being waited for synchronously are answered with an error.
+	void forget(CallbackMap* callbacks);
+
+	// Passes an error response saying "why" to all "callbacks".
+	static void fail(const CallbackMap& callbacks, const std::string& why);
+
+	// Sends "req" to the server under a newly allocated tag, which is
+	// stored in "tag". Any number of requests may be outstanding at the
+	// same time. If "value" is given, it is sent as the value of the
+	// request without being copied into "req" first. Should the request
+	// be sent only in part, the connection is dropped. If there is no
+	// connection yet, it is established first, unless "async" is set, in
+	// which case connecting is only started and the request is queued.
+	Status send(Request* req, int32_t* tag, const char* value = 0,
+			size_t len = 0, bool async = false);
+
+	// Waits for the response to the request sent under "tag" and stores
+	// it in "res". Responses to other requests which arrive in the
+	// meantime are kept until they are asked for.
+	Status recv(int32_t tag, Response* res);
+
+	// Sends "req" and waits for its response.
+	Status call(Request* req, Response* res, const char* value = 0,
+			size_t len = 0);
+
+	// Sends a GET for "file" and stores the response into "res". Errors
+	// reported by the server are returned as well.
+	Status get(const std::string& file, int64_t* storerev, Response* res);
+
+	// Declares that nobody is interested in the response to "tag" any
+	// more. It will be dropped once it arrives, freeing the tag.
+	void abandon(int32_t tag);
+
+	// Sends "req" for consecutive offsets starting at "off", keeping up to
+	// the window of requests in flight, and passes the responses to "fn"
+	// in order. Stops after "lim" responses (unless "lim" is negative),
+	// when the server reports the end of the range or when "fn" returns
+	// false.
+	Status fetchRange(Request* req, int32_t off, int lim,
+			std::function<bool (Response*)> fn);
+
+	// Sends "req" and arranges for "done" to be called with the response
+	// once it has been read. The tag of the request is stored into "tag",
+	// if given.
+	Status sendAsync(Request* req, std::function<void (Response*)> done,
+			const char* value = 0, size_t len = 0,
+			int32_t* tag = 0);
+
+	// Like fetchRange(), but returns after sending the first window of
+	// requests. "done" is called once the last response was processed.
+	struct RangeState;
+	Status fetchRangeAsync(Request* req, int32_t off, int lim,
+			std::function<bool (Response*)> fn,
+			std::function<void (Status)> done);
+	void fillRange(std::shared_ptr<RangeState> st);
+	void rangeResponse(std::shared_ptr<RangeState> st, int32_t off,
+			Response* res);
+
+	// Waits for at least one response and processes all responses which
+	// have been received completely.
+	Status readResponse();
+
+	// Whether "rbuf_" holds a complete response.
+	bool frameReady();
+
+	// Appends what the socket has to offer to "rbuf_", waiting up to
+	// "timeout" milliseconds if there is nothing yet.
+	Status fill(int timeout);
+
+	// Processes all complete responses in "rbuf_".
+	Status readFrames();
+
+	// Files "res" under its tag, or passes it to its callback for
+	// asynchronous requests.
+	void dispatch(Response* res);
 
 	// Error which may have occured during initialization
-	Error* error_;
+	Status error_;
 	bool valid_;
 	int timeout_;
+	int window_;
+
+	// Addresses of the cluster members and the secret to authenticate
+	// with, from the URI. For cluster names, "addrs_" is filled in by
+	// resolve() and "cached_" tells whether they were remembered from an
+	// earlier lookup.
+	QVector<QString> addrs_;
+	QString secret_;
+	QString name_;
+	QString buri_;
+	bool cached_;
+
+	// Whether connecting has been attempted yet, and the connections
+	// started by startDial() along with the indices of their addresses
+	// and the time they were started at.
+	bool dialed_;
+	std::vector<std::pair<int, Transport*> > dialing_;
+	std::chrono::steady_clock::time_point dial_started_;
+
+	// Connection to the Doozer service, and the index of its address.
+	Transport* conn_;
+	int addr_;
+
+	// Buffer the requests are framed in.
+	std::string wbuf_;
+
+	// Requests made while the connection is coming up, or while the
+	// server hasn't let us in yet, in the order they were made.
+	std::string queued_;
+	bool authing_;
+
+	// Data received from the server, the part before "rpos_" of which
+	// has already been processed.
+	std::string rbuf_;
+	size_t rpos_;
+
+	// Tag to try for the next request.
+	int32_t next_tag_;
+
+	// Requests which have been sent but not been picked up by recv() yet,
+	// by tag. The response is 0 until it has arrived.
+	std::map<int32_t, Response*> pending_;
+
+	// Tags from "pending_" whose response will be discarded.
+	std::set<int32_t> abandoned_;
+
+	// Tags from "pending_" whose response is handed to a callback.
+	CallbackMap callbacks_;
+};
+
+// Watches many globs at a time over a single connection. Every
+// subscription has a WAIT of its own outstanding, told apart from the
+// others by its tag, and the events are passed to the subscriber they
+// belong to as they are read.
+//
+// If the connection fails, the watcher reconnects and every subscription
+// resumes right after the last event it delivered. Should the server no
+// longer have the changes since then, the subscription ends with a
+// TOO_LATE status and the subscriber has to read the current state anew.
+class Watcher {
+public:
+	// Creates a watcher which sends its requests over "conn". "conn" must
+	// outlive the watcher.
+	Watcher(Conn* conn);
+	virtual ~Watcher();
+
+	// Calls "fn" for every change to a file matching "glob", in order,
+	// starting at revision "rev". The id of the new subscription is
+	// stored into "id". If waiting for the next change fails, "fn" is
+	// called with the error and the subscription ends.
+	virtual Status Subscribe(std::string glob, int64_t rev, EventFunc fn,
+			int* id);
+	virtual Status Subscribe(QString glob, int64_t rev, EventFunc fn,
+			int* id);
+
+	// Like Subscribe(), but keeps WAITs for up to "window" successive
+	// revisions outstanding at a time, so that the events of a busy glob
+	// don't each have to wait for a round trip. All events which become
+	// ready during one Poll() are passed to "fn" together, in order. This
+	// pays off when most revisions match "glob"; otherwise most of the
+	// WAITs are answered with events which have been seen already.
+	virtual Status SubscribeStream(std::string glob, int64_t rev,
+			int window, EventsFunc fn, int* id);
+	virtual Status SubscribeStream(QString glob, int64_t rev, int window,
+			EventsFunc fn, int* id);
+
+	// Ends the subscription "id". Its callback isn't called any more.
+	virtual void Unsubscribe(int id);
+
+	// Number of active subscriptions.
+	virtual int Size();
+
+	// Revision the subscription "id" continues at, i.e. one past the last
+	// event it delivered, or -1 if there is no such subscription.
+	virtual int64_t Rev(int id);
+
+	// Passes the events which have arrived to their subscribers, waiting
+	// up to "timeout" milliseconds for the first one if there are none
+	// yet. Events are only passed on from here, even if their responses
+	// were read by some other operation on the connection. An error is
+	// returned if the connection failed and none of the cluster members
+	// could be reached again.
+	virtual Status Poll(int timeout);
+
+	// Passes events on until all subscriptions have ended or the
+	// connection is lost for good.
+	virtual Status Run();
+
+private:
+	struct Sub;
+
+	// Sends WAITs for the revisions following the last one sent for
+	// "sub", until its window is full.
+	Status arm(std::shared_ptr<Sub> sub);
+
+	// Processes the event "ev" or error "st" in response to the WAIT of
+	// "sub" at revision "rev".
+	void response(std::shared_ptr<Sub> sub, int64_t rev, Status st,
+			Event* ev);
+
+	// Passes the events collected by response() to their subscribers.
+	void deliver();
+
+	// Ends "sub", telling its subscriber about "st".
+	void end(std::shared_ptr<Sub> sub, Status st);
+
+	// Cancels the outstanding WAITs of "sub" and detaches it from the
+	// watcher.
+	void cancel(std::shared_ptr<Sub> sub);
+
+	// Reconnects and sends the WAITs of all subscriptions again.
+	Status resume();
+
+	Conn* conn_;
+	int next_id_;
+
+	// Whether WAITs couldn't be sent and the connection needs to be
+	// established again.
+	bool broken_;
+
+	// Active subscriptions, by id.
+	std::map<int, std::shared_ptr<Sub> > subs_;
+
+	// Subscriptions with events or an error to deliver.
+	std::vector<std::shared_ptr<Sub> > due_;
+};
+
+// Client side cache for reads of files below a number of directories.
+// The directories are watched for changes over the connection, and the
+// cached files and listings are updated as the changes come in. The
+// changes are read whenever the connection reads responses, e.g. during
+// Poll() or any other operation on it.
+class Cache {
+public:
+	// Creates a cache for reads on "conn" which holds up to "budget" bytes
+	// of file contents and directory listings. "conn" must outlive the
+	// cache.
+	Cache(Conn* conn, size_t budget);
+	virtual ~Cache();
+
+	// Starts caching the files below "dir", as of the current revision.
+	virtual Status Watch(std::string dir);
+	virtual Status Watch(QString dir);
+
+	// Same as the respective Conn operations. Reads below a watched
+	// directory at revisions up to Rev() of that directory are answered
+	// from the cache where possible. If "storerev" is NULL, Rev() is used
+	// as the revision, so the result may lag behind the server by the
+	// changes which haven't been read yet. Everything else is passed on to
+	// the connection.
+	virtual Status Get(std::string file, int64_t* storerev,
+			std::string* buf, int64_t* filerev);
+	virtual Status Get(QString file, int64_t* storerev, QByteArray* buf,
+			int64_t* filerev);
+	virtual Status Stat(std::string path, int64_t* storerev,
+			int* len, int64_t* filerev);
+	virtual Status Stat(QString path, int64_t* storerev,
+			int* len, int64_t* filerev);
+	virtual Status Getdir(std::string dir, int64_t rev, int32_t off,
+			int lim, std::vector<std::string>* names);
+	virtual Status Getdir(QString dir, int64_t rev, int32_t off, int lim,
+			QVector<QString>* names);
+
+	// The revision up to which all changes to "path" are known to the
+	// cache, or -1 if it isn't below a watched directory.
+	virtual int64_t Rev(std::string path);
+	virtual int64_t Rev(QString path);
+
+	// Reads the changes which have arrived, waiting up to "timeout"
+	// milliseconds for the first one if there are none yet.
+	virtual Status Poll(int timeout);
+
+	// Number of reads answered from the cache and of reads below a
+	// watched directory which had to go to the server.
+	virtual uint64_t Hits();
+	virtual uint64_t Misses();
+
+	// Number of bytes currently accounted to the cache.
+	virtual size_t Size();
+
+private:
+	struct Scope;
+	struct File;
+	struct Listing;
+
+	// Issues the WAIT for the next change below "sc", watching from the
+	// current revision if "sc" isn't being watched yet.
+	Status arm(std::shared_ptr<Scope> sc);
+
+	// Applies the change "ev" below "sc", or forgets about everything
+	// below it if watching failed with "st".
+	void apply(std::shared_ptr<Scope> sc, Status st, Event* ev);
+
+	// The innermost watched directory "path" is in, or 0.
+	std::shared_ptr<Scope> scope(const std::string& path);
+
+	// Forgets about everything below "sc" and stops watching it.
+	void reset(std::shared_ptr<Scope> sc);
+
+	// Looks up "path" as of revision "rev", fetching it at the revision
+	// of "sc" if it isn't cached yet. Returns 0 if the cache can't tell,
+	// and sets "st" if fetching failed. What was fetched but can't be
+	// cached is returned in "tmp". "body" says whether the contents of
+	// the file are needed.
+	File* file(std::shared_ptr<Scope> sc, const std::string& path,
+			int64_t rev, bool body, File* tmp, Status* st);
+	Listing* listing(std::shared_ptr<Scope> sc, const std::string& dir,
+			int64_t rev, Listing* tmp, Status* st);
+
+	// Marks an entry as recently used and evicts the least recently used
+	// ones until the cache fits its budget.
+	void touch(std::list<std::pair<bool, std::string> >::iterator it);
+	void shrink();
+	void drop(bool dir, const std::string& path);
+
+	Conn* conn_;
+	size_t budget_;
+	size_t size_;
+	uint64_t hits_;
+	uint64_t misses_;
+
+	// Watched directories, by name.
+	std::map<std::string, std::shared_ptr<Scope> > scopes_;
+
+	// Cached files and directory listings, by path.
+	std::map<std::string, File> files_;
+	std::map<std::string, Listing> dirs_;
+
+	// Cached entries, least recently used last. The flag tells
+	// listings from files.
+	std::list<std::pair<bool, std::string> > lru_;
+};
+
+// Set of connections to the members of a cluster. Reads go to the
+// member which currently answers fastest, while writes all go to the
+// same member. Members whose connection fails are left out for a while
+// and then dialed again in the background, so reads don't wait for them
+// unless no other member can be reached.
+//
+// The pool keeps a moving average of the round trip time of every member,
+// taken from the reads it sends there, including the answers to hedged
+// reads which came in too late to be used. A member which keeps such a
+// read waiting counts as at least as slow as it has taken so far, so it
+// loses its rank right away. Members which haven't been used for a while
+// are sent a NOP now and then, so a member which got faster again is
+// noticed. Reads don't wait for the answers; they are picked up by the
+// reads which follow.
+class Pool {
+public:
+	// Connects to the cluster members listed in "uri", which takes the
+	// same form as for Conn. If "size" is positive, only that many of the
+	// members, picked at random, are used. All of them are dialed at the
+	// same time, and the constructor returns once each is either up or
+	// has failed.
+	Pool(std::string uri, int size = 0);
+	Pool(QString uri, int size = 0);
+	virtual ~Pool();
+
+	// Whether at least one member could be reached.
+	virtual bool IsValid();
+
+	// The error which ocurred when connecting to the last member which
+	// couldn't be reached.
+	virtual Status GetStatus();
+
+	// Number of members in the pool, and of those which can be reached.
+	virtual int Size();
+	virtual int Healthy();
+
+	// Sets the timeout of the operations on all members.
+	virtual void SetTimeout(int timeout);
+
+	// Enables hedging of Get, Stat, Getdir and Rev: if the member a read
+	// was sent to hasn't answered once the "percentile" (e.g. 0.95) of the
+	// recent read latencies has passed, the read is sent to another
+	// member as well and whichever answer comes first is used. Getdir is
+	// compared only with other Getdirs. 0 turns hedging off, which is
+	// the default.
+	virtual void SetHedging(double percentile);
+
+	// Same as the respective Conn operations. Reads are sent to the
+	// fastest member, and retried on the next fastest one if the
+	// connection to the first one failed. Running out of time is
+	// reported as TIMEOUT without trying elsewhere; for a Wait() it just
+	// means nothing changed.
+	virtual Status Get(std::string file, int64_t* storerev,
+			std::string* buf, int64_t* filerev);
+	virtual Status Get(QString file, int64_t* storerev, QByteArray* buf,
+			int64_t* filerev);
+	virtual Status Stat(std::string path, int64_t* storerev,
+			int* len, int64_t* filerev);
+	virtual Status Stat(QString path, int64_t* storerev,
+			int* len, int64_t* filerev);
+	virtual Status Rev(int64_t* rev);
+	virtual Status Getdir(std::string dir, int64_t rev, int32_t off,
+			int lim, std::vector<std::string>* names);
+	virtual Status Getdir(QString dir, int64_t rev, int32_t off, int lim,
+			QVector<QString>* names);
+	virtual Status Wait(std::string glob, int64_t rev, Event* ev);
+	virtual Status Wait(QString glob, int64_t rev, Event* ev);
+
+	// Writes go to the first member which can be reached, and are not
+	// retried elsewhere since they may have been applied already.
+	virtual Status Set(std::string file, int64_t oldRev, int64_t* newRev,
+			const char *body, size_t len);
+	virtual Status Set(QString file, int64_t oldRev, int64_t* newRev,
+			QByteArray body);
+	virtual Status Del(std::string file, int64_t rev);
+	virtual Status Del(QString file, int64_t rev);
+
+	// A connection to a member which can be reached, for the operations
+	// the pool doesn't offer itself, or 0 if there is none.
+	virtual Conn* Pick();
+
+private:
+	struct Member;
+
+	void init(QString uri, int size);
+
+	// Waits until all members which are being connected to are either up
+	// or have failed, watching all of them at once.
+	void settle();
+
+	// Starts reconnecting to members which failed a while ago and picks
+	// up how far that got, waiting only if no member is left. Also
+	// sends a NOP to those whose round trip time is out of date, and
+	// picks up the answers to earlier ones.
+	void revive();
+
+	// The member to send the next read to, or the one to send writes to.
+	Member* next();
+	Member* primary();
+
+	// Runs "op" on a member, moving on to the next one as long as "op"
+	// fails because of the connection and "retry" is set. Members which
+	// merely time out are kept. If "timed" is set, "op" is a single round
+	// trip and its duration is taken into account for the round trip
+	// time of the member. The duration of a read is also added to
+	// "latencies", if given.
+	Status run(std::function<Status (Conn*)> op, bool retry,
+			bool timed, std::deque<double>* latencies = 0);
+
+	// Like run(), but for reads sent with the asynchronous operation
+	// "op", which calls its callback with the result. The read is hedged
+	// as described for SetHedging(), with the delay taken from
+	// "latencies". "over" is set once the result is in;
+	// "op" must not store answers arriving after that, but still has to
+	// pass them on, so they count towards the round trip time of their
+	// member.
+	Status hedge(std::function<Status (Conn*, DoneFunc)> op,
+			std::shared_ptr<bool> over, bool timed,
+			std::deque<double>* latencies);
+
+	// Adds the duration "ms" of a read to "latencies", if given.
+	void record(std::deque<double>* latencies, double ms);
+
+	// Milliseconds to wait before hedging a read with the given recent
+	// latencies, or -1 not to hedge.
+	int hedgeDelay(const std::deque<double>& latencies);
+
+	std::vector<Member*> members_;
+	int timeout_;
+	Status error_;
+
+	// Percentile of the recent latencies after which to hedge, or 0.
+	double hedging_;
+
+	// Durations of the most recent reads in milliseconds, newest last.
+	// Getdir takes many round trips, so it has its own.
+	std::deque<double> latencies_;
+	std::deque<double> dirLatencies_;
+};
+
+// Connection which any number of threads may use at the same time. The
+// requests of all threads are handed to an I/O thread through a lock-free
+// queue and sent over "size" connections to the cluster, taking turns, so
+// threads don't need connections of their own. Each operation blocks the
+// calling thread until its response has arrived.
+class SharedConn {
+public:
+	// Connects to the cluster at "uri" as Conn does, from the I/O thread.
+	// Connections lost later on are established anew in the background,
+	// without holding up the requests on the other ones.
+	SharedConn(std::string uri, std::string boot_uri, int size = 1);
+	SharedConn(QString uri, QString boot_uri, int size = 1);
+
+	// Stops the I/O thread. No operations may be in progress any more.
+	virtual ~SharedConn();
+
+	// Whether all connections were established successfully, and the
+	// error if not.
+	virtual bool IsValid();
+	virtual Status GetStatus();
+
+	// Sets the timeout of the operations. A Wait() which isn't answered in
+	// time returns TIMEOUT. For any other request, the connection it was
+	// sent on is sent a NOP; only if that goes unanswered for as long as
+	// well is the connection considered dead, and the requests on it
+	// fail.
+	virtual void SetTimeout(int timeout);
+
+	// Same as the respective Conn operations.
+	virtual Status Get(std::string file, int64_t* storerev,
+			std::string* buf, int64_t* filerev);
+	virtual Status Get(QString file, int64_t* storerev, QByteArray* buf,
+			int64_t* filerev);
+	virtual Status Set(std::string file, int64_t oldRev, int64_t* newRev,
+			const char *body, size_t len);
+	virtual Status Set(QString file, int64_t oldRev, int64_t* newRev,
+			QByteArray body);
+	virtual Status Del(std::string file, int64_t rev);
+	virtual Status Del(QString file, int64_t rev);
+	virtual Status Stat(std::string path, int64_t* storerev,
+			int* len, int64_t* filerev);
+	virtual Status Stat(QString path, int64_t* storerev,
+			int* len, int64_t* filerev);
+	virtual Status Rev(int64_t* rev);
+	virtual Status Nop();
+	virtual Status Getdir(std::string dir, int64_t rev, int32_t off,
+			int lim, std::vector<std::string>* names);
+	virtual Status Getdir(QString dir, int64_t rev, int32_t off, int lim,
+			QVector<QString>* names);
+	virtual Status Wait(std::string glob, int64_t rev, Event* ev);
+	virtual Status Wait(QString glob, int64_t rev, Event* ev);
+
+	// Runs "fn" on the I/O thread with one of the connections, e.g. to
+	// send asynchronous requests. Their callbacks are run on the I/O
+	// thread as well, so neither may block.
+	virtual void Submit(std::function<void (Conn*)> fn);
+
+private:
+	struct Op;
+	struct Done;
+	struct Call;
+
+	typedef std::multimap<std::chrono::steady_clock::time_point,
+		std::shared_ptr<Call> > Deadlines;
+
+	void init(QString uri, QString buri, int size);
+
+	// Sends a request using "op", which returns an error if it couldn't
+	// be sent and calls "done" once the response has arrived otherwise,
+	// and waits for that.
+	Status call(std::function<Status (Conn*, DoneFunc)> op);
+
+	// Same, where "op" stores the tag of the request into its last
+	// argument if "wait" is set, so the WAIT can be cancelled once the
+	// timeout is up.
+	Status request(std::function<Status (Conn*, DoneFunc, int32_t*)> op,
+			bool wait);
+
+	// Starts the timeout of "call", and passes "st" on to whoever waits
+	// for it unless that has been done already.
+	void arm(std::shared_ptr<Call> call);
+	void finish(std::shared_ptr<Call> call, Status st);
+
+	// Deals with the calls whose timeout is up, and returns the number of
+	// milliseconds until the next one is, or -1.
+	int expire();
+
+	// Checks whether "c" still answers, unless that's under way.
+	void probe(Conn* c);
+
+	// Body of the I/O thread, which signals "up" once it has connected.
+	void run(QString uri, QString buri, int size, Done* up);
+
+	// Runs the operations submitted since the last call.
+	void drain();
+
+	std::thread thread_;
+	Status error_;
+
+	// Operations submitted but not yet picked up by the I/O thread, most
+	// recent first.
+	std::atomic<Op*> queue_;
+
+	// Pipe the I/O thread is woken up through.
+	int wake_[2];
+
+	std::atomic<bool> stop_;
+	std::atomic<int> timeout_;
+
+	// Owned by the I/O thread.
+	std::vector<Conn*> conns_;
+	size_t turn_;
 
-	// Connection to the Doozer service.
-	QTcpSocket* conn_;
+	// Calls waiting for a response, by when they time out, and the
+	// connections which have a NOP on its way.
+	Deadlines deadlines_;
+	std::set<Conn*> probing_;
 };
 
 }  // namespace doozer
@@ -0,0 +1,364 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DOOZER_DOOZER_CORO_H
+#define DOOZER_DOOZER_CORO_H 1
+
+// Coroutine interface to the asynchronous operations of doozer::Conn.
+// Include after doozer.h; requires C++20.
+
+#if __cplusplus < 202002L
+#error "doozer_coro.h requires C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace doozer {
+
+// Results of the operations of CoConn.
+struct DoneResult {
+	Status status;
+};
+
+struct RevResult {
+	Status status;
+	int64_t rev = 0;
+};
+
+struct GetResult {
+	Status status;
+	std::string body;
+	int64_t rev = 0;
+};
+
+struct StatResult {
+	Status status;
+	int len = 0;
+	int64_t rev = 0;
+};
+
+struct GetdirResult {
+	Status status;
+	std::vector<std::string> names;
+};
+
+struct EventResult {
+	Status status;
+	Event ev;
+};
+
+// Coroutine type for tasks run by CoConn::Spawn(). Tasks start running
+// right away and are destroyed by the CoConn once they are finished, or
+// along with it. A task destroyed while waiting for a response is never
+// resumed; WAITs it has outstanding are cancelled.
+class Task {
+public:
+	struct promise_type {
+		Task get_return_object()
+		{
+			return Task(std::coroutine_handle<promise_type>::
+					from_promise(*this));
+		}
+
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	Task(Task&& other) : handle_(other.handle_) { other.handle_ = 0; }
+	Task(const Task&) = delete;
+
+	~Task()
+	{
+		if (handle_)
+			handle_.destroy();
+	}
+
+	// Whether the task has run to completion.
+	bool Done() const { return !handle_ || handle_.done(); }
+
+private:
+	explicit Task(std::coroutine_handle<promise_type> handle)
+	: handle_(handle)
+	{
+	}
+
+	std::coroutine_handle<promise_type> handle_;
+};
+
+// An operation of CoConn which can be co_await'ed for its result of type
+// "R". The request is sent when the operation is awaited, and the
+// awaiting coroutine is resumed from Conn::Poll() once the response has
+// arrived.
+//
+// The operation lives in the frame of the awaiting coroutine, so the
+// callback only touches it while "alive_" says the frame is still there.
+// Requests which can be cancelled store their tag for the destructor.
+template<typename R>
+class Op {
+public:
+	typedef std::function<void (R)> Callback;
+	typedef std::function<Status (Callback, int32_t* tag)> StartFunc;
+
+	Op(Conn* conn, StartFunc start)
+	: conn_(conn), start_(start), alive_(new bool(true)), tag_(-1),
+	  waiting_(false)
+	{
+	}
+
+	Op(Op&& other) = default;
+	Op(const Op&) = delete;
+
+	~Op()
+	{
+		if (!alive_)
+			return;
+
+		*alive_ = false;
+		if (waiting_ && tag_ >= 0)
+			conn_->Cancel(tag_);
+	}
+
+	bool await_ready() { return false; }
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		std::shared_ptr<bool> alive = alive_;
+		Status st = start_([this, h, alive](R res) {
+			if (!*alive)
+				return;
+
+			waiting_ = false;
+			result_ = std::move(res);
+			h.resume();
+		}, &tag_);
+
+		// The request couldn't be sent, so there won't be a response
+		// to wait for.
+		if (!st.Ok())
+		{
+			result_.status = st;
+			return false;
+		}
+
+		waiting_ = true;
+		return true;
+	}
+
+	R await_resume() { return std::move(result_); }
+
+private:
+	Conn* conn_;
+	StartFunc start_;
+	std::shared_ptr<bool> alive_;
+	int32_t tag_;
+	bool waiting_;
+	R result_;
+};
+
+// Awaitable wrapper around a Conn, e.g.
+//
+//	doozer::Task watch(doozer::CoConn* c, std::string glob) {
+//		doozer::RevResult r = co_await c->Rev();
+//		for (int64_t rev = r.rev + 1;;) {
+//			doozer::EventResult e = co_await c->Wait(glob, rev);
+//			...
+//			rev = e.ev.Rev() + 1;
+//		}
+//	}
+//
+//	doozer::CoConn c(&conn);
+//	c.Spawn(watch(&c, "/config/**"));
+//	c.Run();
+//
+// Any number of tasks can be waiting for responses on the same
+// connection. The Conn and the CoConn must only be used from the thread
+// calling Run().
+class CoConn {
+public:
+	explicit CoConn(Conn* conn) : conn_(conn) {}
+
+	Op<RevResult> Set(std::string file, int64_t oldRev, std::string body)
+	{
+		Conn* c = conn_;
+		return Op<RevResult>(c, [c, file, oldRev, body](
+					Op<RevResult>::Callback done,
+					int32_t*) {
+			return c->SetAsync(file, oldRev, body.data(),
+					body.length(), [done](Status st,
+						int64_t rev) {
+				RevResult res;
+				res.status = st;
+				res.rev = rev;
+				done(std::move(res));
+			});
+		});
+	}
+
+	Op<DoneResult> Del(std::string file, int64_t rev)
+	{
+		Conn* c = conn_;
+		return Op<DoneResult>(c, [c, file, rev](
+					Op<DoneResult>::Callback done,
+					int32_t*) {
+			return c->DelAsync(file, rev, [done](Status st) {
+				DoneResult res;
+				res.status = st;
+				done(std::move(res));
+			});
+		});
+	}
+
+	// "storerev" is read when the operation is awaited.
+	Op<GetResult> Get(std::string file, int64_t* storerev = 0)
+	{
+		Conn* c = conn_;
+		return Op<GetResult>(c, [c, file, storerev](
+					Op<GetResult>::Callback done,
+					int32_t*) {
+			return c->GetAsync(file, storerev, [done](Status st,
+						const std::string& body,
+						int64_t rev) {
+				GetResult res;
+				res.status = st;
+				res.body = body;
+				res.rev = rev;
+				done(std::move(res));
+			});
+		});
+	}
+
+	// "storerev" is read when the operation is awaited.
+	Op<StatResult> Stat(std::string path, int64_t* storerev = 0)
+	{
+		Conn* c = conn_;
+		return Op<StatResult>(c, [c, path, storerev](
+					Op<StatResult>::Callback done,
+					int32_t*) {
+			return c->StatAsync(path, storerev, [done](Status st,
+						int len, int64_t rev) {
+				StatResult res;
+				res.status = st;
+				res.len = len;
+				res.rev = rev;
+				done(std::move(res));
+			});
+		});
+	}
+
+	Op<RevResult> Rev()
+	{
+		Conn* c = conn_;
+		return Op<RevResult>(c, [c](Op<RevResult>::Callback done,
+					int32_t*) {
+			return c->RevAsync([done](Status st, int64_t rev) {
+				RevResult res;
+				res.status = st;
+				res.rev = rev;
+				done(std::move(res));
+			});
+		});
+	}
+
+	Op<GetdirResult> Getdir(std::string dir, int64_t rev, int32_t off = 0,
+			int lim = -1)
+	{
+		Conn* c = conn_;
+		return Op<GetdirResult>(c, [c, dir, rev, off, lim](
+					Op<GetdirResult>::Callback done,
+					int32_t*) {
+			return c->GetdirAsync(dir, rev, off, lim, [done](
+						Status st,
+						const std::vector<std::string>&
+						names) {
+				GetdirResult res;
+				res.status = st;
+				res.names = names;
+				done(std::move(res));
+			});
+		});
+	}
+
+	Op<EventResult> Wait(std::string glob, int64_t rev)
+	{
+		Conn* c = conn_;
+		return Op<EventResult>(c, [c, glob, rev](
+					Op<EventResult>::Callback done,
+					int32_t* tag) {
+			return c->WaitAsync(glob, rev, [done](Status st,
+						Event* ev) {
+				EventResult res;
+				res.status = st;
+				res.ev = *ev;
+				done(std::move(res));
+			}, tag);
+		});
+	}
+
+	// Hands "task" to the CoConn, which keeps it until it has finished.
+	void Spawn(Task task)
+	{
+		tasks_.push_back(std::move(task));
+	}
+
+	// Runs the spawned tasks by processing the responses they're waiting
+	// for, until all of them have finished.
+	Status Run()
+	{
+		for (;;)
+		{
+			tasks_.remove_if([](const Task& t) {
+				return t.Done();
+			});
+
+			if (tasks_.empty())
+				return Status();
+
+			Status st = conn_->Poll(-1);
+			if (!st.Ok())
+				return st;
+		}
+	}
+
+private:
+	Conn* conn_;
+	std::list<Task> tasks_;
+};
+
+}  // namespace doozer
+
+#endif /* DOOZER_DOOZER_CORO_H */
@@ -0,0 +1,221 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <QtCore/QString>
+
+#include "msg.h"
+#include "doozer.h"
+
+namespace doozer {
+
+Status
+Conn::SetAsync(QString file, int64_t oldRev, QByteArray body, RevFunc cb)
+{
+	return SetAsync(file.toStdString(), oldRev, body.data(), body.length(),
+			cb);
+}
+
+Status
+Conn::SetAsync(std::string file, int64_t oldRev, const char *body,
+		size_t len, RevFunc cb)
+{
+	Request req;
+
+	req.set_verb(Request::SET);
+	req.set_path(file);
+	req.set_rev(oldRev);
+
+	return sendAsync(&req, [cb](Response* res) {
+		Status st(res);
+		cb(st, st.Ok() ? res->rev() : 0);
+	}, body, len);
+}
+
+Status
+Conn::DelAsync(QString file, int64_t rev, DoneFunc cb)
+{
+	return DelAsync(file.toStdString(), rev, cb);
+}
+
+Status
+Conn::DelAsync(std::string file, int64_t rev, DoneFunc cb)
+{
+	Request req;
+
+	req.set_verb(Request::DEL);
+	req.set_path(file);
+	req.set_rev(rev);
+
+	return sendAsync(&req, [cb](Response* res) {
+		cb(Status(res));
+	});
+}
+
+Status
+Conn::GetAsync(QString file, int64_t* storerev, GetFunc cb)
+{
+	return GetAsync(file.toStdString(), storerev, cb);
+}
+
+Status
+Conn::GetAsync(std::string file, int64_t* storerev, GetFunc cb)
+{
+	Request req;
+
+	req.set_verb(Request::GET);
+	req.set_path(file);
+	if (storerev)
+		req.set_rev(*storerev);
+
+	return sendAsync(&req, [cb](Response* res) {
+		Status st(res);
+		cb(st, res->value(), st.Ok() ? res->rev() : 0);
+	});
+}
+
+Status
+Conn::StatAsync(QString path, int64_t* storerev, StatFunc cb)
+{
+	return StatAsync(path.toStdString(), storerev, cb);
+}
+
+Status
+Conn::StatAsync(std::string path, int64_t* storerev, StatFunc cb)
+{
+	Request req;
+
+	req.set_verb(Request::STAT);
+	req.set_path(path);
+	if (storerev)
+		req.set_rev(*storerev);
+
+	return sendAsync(&req, [cb](Response* res) {
+		Status st(res);
+		cb(st, st.Ok() ? res->len() : 0,
+				st.Ok() ? res->rev() : 0);
+	});
+}
+
+Status
+Conn::RevAsync(RevFunc cb)
+{
+	Request req;
+
+	req.set_verb(Request::REV);
+
+	return sendAsync(&req, [cb](Response* res) {
+		Status st(res);
+		cb(st, st.Ok() ? res->rev() : 0);
+	});
+}
+
+Status
+Conn::NopAsync(DoneFunc cb)
+{
+	Request req;
+
+	req.set_verb(Request::NOP);
+
+	return sendAsync(&req, [cb](Response* res) {
+		cb(Status(res));
+	});
+}
+
+Status
+Conn::GetdirAsync(QString dir, int64_t rev, int32_t off, int lim,
+		GetdirFunc cb)
+{
+	return GetdirAsync(dir.toStdString(), rev, off, lim, cb);
+}
+
+Status
+Conn::GetdirAsync(std::string dir, int64_t rev, int32_t off, int lim,
+		GetdirFunc cb)
+{
+	std::shared_ptr<std::vector<std::string> > names(
+			new std::vector<std::string>());
+	Request req;
+
+	req.set_verb(Request::GETDIR);
+	req.set_path(dir);
+	req.set_rev(rev);
+
+	return fetchRangeAsync(&req, off, lim, [names](Response* res) {
+		names->push_back(res->path());
+		return true;
+	}, [names, cb](Status st) {
+		cb(st, *names);
+	});
+}
+
+Status
+Conn::WaitAsync(QString glob, int64_t rev, EventFunc cb)
+{
+	return WaitAsync(glob.toStdString(), rev, cb);
+}
+
+Status
+Conn::WaitAsync(std::string glob, int64_t rev, EventFunc cb)
+{
+	return WaitAsync(glob, rev, cb, 0);
+}
+
+Status
+Conn::WaitAsync(std::string glob, int64_t rev, EventFunc cb, int32_t* tag)
+{
+	Request req;
+
+	req.set_verb(Request::WAIT);
+	req.set_path(glob);
+	req.set_rev(rev);
+
+	return sendAsync(&req, [cb](Response* res) {
+		Status st(res);
+		Event ev;
+
+		if (st.Ok())
+		{
+			ev.Rev(res->rev());
+			ev.Path(res->path());
+			ev.Body(res->value());
+			ev.Flags(res->flags());
+		}
+
+		cb(st, &ev);
+	}, 0, 0, tag);
+}
+
+}  // namespace doozer
@@ -32,186 +32,160 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <arpa/inet.h>
+#include <string.h>
 
 #include <string>
 #include <QtCore/QString>
 
-#include "msg.pb.h"
+#include "msg.h"
 #include "doozer.h"
 
 namespace doozer {
 
-Error*
+Status
 Conn::Set(QString file, int64_t oldRev, int64_t* newRev, QByteArray body)
 {
 	return Set(file.toStdString(), oldRev, newRev, body.data(),
 			body.length());
 }
 
-Error*
+Status
 Conn::Set(std::string file, int64_t oldRev, int64_t* newRev, const char *body,
 		size_t len)
 {
-	Error* err;
 	Request req;
 	Response res;
+	Status st;
 
 	req.set_verb(Request::SET);
 	req.set_path(file);
-	req.set_value(body, len);
 	req.set_rev(oldRev);
 
-	err = send(req);
-	if (err)
-		return err;
-
-	err = recv(&res);
-	if (err)
-		return err;
+	st = call(&req, &res, body, len);
+	if (!st.Ok())
+		return st;
 
 	if (!res.has_err_code())
 	{
 		if (newRev)
 			*newRev = res.rev();
-		return 0;
+		return Status();
 	}
 
-	if (res.has_err_detail())
-		return new Error(Response_Err_Name(res.err_code()) + ": " +
-				res.err_detail());
-	else
-		return new Error(Response_Err_Name(res.err_code()));
+	return Status(&res);
 }
 
-Error*
+Status
 Conn::Del(QString file, int64_t rev)
 {
 	return Del(file.toStdString(), rev);
 }
 
-Error*
+Status
 Conn::Del(std::string file, int64_t rev)
 {
-	Error* err;
 	Request req;
 	Response res;
+	Status st;
 
 	req.set_verb(Request::DEL);
 	req.set_path(file);
 	req.set_rev(rev);
 
-	err = send(req);
-	if (err)
-		return err;
-
-	err = recv(&res);
-	if (err)
-		return err;
+	st = call(&req, &res);
+	if (!st.Ok())
+		return st;
 
-	if (!res.has_err_code())
-		return 0;
-
-	if (res.has_err_detail())
-		return new Error(Response_Err_Name(res.err_code()) + ": " +
-				res.err_detail());
-	else
-		return new Error(Response_Err_Name(res.err_code()));
+	return Status(&res);
 }
 
-Error*
+Status
 Conn::Nop()
 {
-	Error* err;
 	Request req;
 	Response res;
+	Status st;
 
 	req.set_verb(Request::NOP);
 
-	err = send(req);
-	if (err)
-		return err;
+	st = call(&req, &res);
+	if (!st.Ok())
+		return st;
 
-	err = recv(&res);
-	if (err)
-		return err;
+	return Status(&res);
+}
 
-	if (!res.has_err_code())
-		return 0;
+Status
+Conn::get(const std::string& file, int64_t* storerev, Response* res)
+{
+	Request req;
+	Status st;
 
-	if (res.has_err_detail())
-		return new Error(Response_Err_Name(res.err_code()) + ": " +
-				res.err_detail());
-	else
-		return new Error(Response_Err_Name(res.err_code()));
+	req.set_verb(Request::GET);
+	req.set_path(file);
+	if (storerev)
+		req.set_rev(*storerev);
+
+	st = call(&req, res);
+	if (!st.Ok())
+		return st;
+
+	if (res->has_err_code())
+		return Status(res);
+
+	return Status();
 }
 
-Error*
+Status
 Conn::Get(QString file, int64_t* storerev, QByteArray* buf, int64_t* filerev)
 {
-	Error* err;
-	std::string res;
+	Response res;
+	Status st = get(file.toStdString(), storerev, &res);
 
-	err = Get(file.toStdString(), storerev, &res, filerev);
+	if (!st.Ok())
+		return st;
 
-	if (err == 0)
-	{
-		buf->clear();
-		buf->append(res.c_str(), res.length());
-	}
+	if (buf)
+		*buf = QByteArray(res.value().data(), res.value().length());
+
+	if (filerev)
+		*filerev = res.rev();
 
-	return err;
+	return Status();
 }
 
-Error*
+Status
 Conn::Get(std::string file, int64_t* storerev, std::string* buf, int64_t* filerev)
 {
-	Error* err;
-	Request req;
 	Response res;
+	Status st = get(file, storerev, &res);
 
-	req.set_verb(Request::GET);
-	req.set_path(file);
-	if (storerev)
-		req.set_rev(*storerev);
+	if (!st.Ok())
+		return st;
 
-	err = send(req);
-	if (err)
-		return err;
+	// The response is thrown away anyway, so its contents can be taken
+	// over rather than copied.
+	if (buf)
+		buf->swap(*res.mutable_value());
 
-	err = recv(&res);
-	if (err)
-		return err;
+	if (filerev)
+		*filerev = res.rev();
 
-	if (!res.has_err_code())
-	{
-		if (buf)
-			*buf = res.value();
-
-		if (filerev)
-			*filerev = res.rev();
-
-		return 0;
-	}
-
-	if (res.has_err_detail())
-		return new Error(Response_Err_Name(res.err_code()) + ": " +
-				res.err_detail());
-	else
-		return new Error(Response_Err_Name(res.err_code()));
+	return Status();
 }
 
-Error*
+Status
 Conn::Stat(QString path, int64_t* storerev, int* len, int64_t* filerev)
 {
 	return Stat(path.toStdString(), storerev, len, filerev);
 }
 
-Error*
+Status
 Conn::Stat(std::string path, int64_t* storerev, int* len, int64_t* filerev)
 {
-	Error* err;
 	Request req;
 	Response res;
+	Status st;
 
 	req.set_verb(Request::STAT);
 	req.set_path(path);
@@ -219,13 +193,9 @@ Conn::Stat(std::string path, int64_t* storerev, int* len, int64_t* filerev)
 	if (storerev)
 		req.set_rev(*storerev);
 
-	err = send(req);
-	if (err)
-		return err;
-
-	err = recv(&res);
-	if (err)
-		return err;
+	st = call(&req, &res);
+	if (!st.Ok())
+		return st;
 
 	if (!res.has_err_code())
 	{
@@ -235,46 +205,34 @@ Conn::Stat(std::string path, int64_t* storerev, int* len, int64_t* filerev)
 		if (filerev)
 			*filerev = res.rev();
 
-		return 0;
+		return Status();
 	}
 
-	if (res.has_err_detail())
-		return new Error(Response_Err_Name(res.err_code()) + ": " +
-				res.err_detail());
-	else
-		return new Error(Response_Err_Name(res.err_code()));
+	return Status(&res);
 }
 
-Error*
+Status
 Conn::Rev(int64_t* rev)
 {
-	Error* err;
 	Request req;
 	Response res;
+	Status st;
 
 	req.set_verb(Request::REV);
 
-	err = send(req);
-	if (err)
-		return err;
-
-	err = recv(&res);
-	if (err)
-		return err;
+	st = call(&req, &res);
+	if (!st.Ok())
+		return st;
 
 	if (!res.has_err_code())
 	{
 		if (rev)
 			*rev = res.rev();
 
-		return 0;
+		return Status();
 	}
 
-	if (res.has_err_detail())
-		return new Error(Response_Err_Name(res.err_code()) + ": " +
-				res.err_detail());
-	else
-		return new Error(Response_Err_Name(res.err_code()));
+	return Status(&res);
 }
 
 }  // namespace doozer
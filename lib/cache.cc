@@ -0,0 +1,676 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+#include "doozer.h"
+
+namespace doozer {
+
+// Flags of events for files which were set or deleted.
+#define EVENT_SET	4
+#define EVENT_DEL	8
+
+// Rough bookkeeping overhead of a cache entry: the map and list nodes and
+// the entry itself.
+#define ENTRY_COST	160
+
+struct Cache::Scope {
+	// The cache this belongs to, or 0 once the cache has been destroyed
+	// while the WAIT was still outstanding.
+	Cache* cache;
+	std::string dir;
+
+	// All changes below "dir" up to this revision have been applied.
+	// -1 while "dir" isn't being watched.
+	int64_t rev;
+
+	// Tag of the outstanding WAIT, or 0.
+	int32_t tag;
+};
+
+struct Cache::File {
+	// The entry describes the file from revision "since" up to the
+	// revision of its scope.
+	int64_t since;
+	int64_t rev;
+	int len;
+
+	// Whether "body" is known, or just the length.
+	bool has_body;
+	std::string body;
+
+	size_t cost;
+	std::list<std::pair<bool, std::string> >::iterator lru;
+};
+
+struct Cache::Listing {
+	int64_t since;
+	std::vector<std::string> names;
+
+	size_t cost;
+	std::list<std::pair<bool, std::string> >::iterator lru;
+};
+
+// Whether "path" is "dir" or below it.
+static bool
+below(const std::string& dir, const std::string& path)
+{
+	if (dir == "/")
+		return !path.empty() && path[0] == '/';
+
+	return path.compare(0, dir.length(), dir) == 0 &&
+		(path.length() == dir.length() || path[dir.length()] == '/');
+}
+
+static size_t
+fileCost(const std::string& path, const std::string& body)
+{
+	return ENTRY_COST + path.length() + body.length();
+}
+
+static size_t
+listingCost(const std::string& dir, const std::vector<std::string>& names)
+{
+	size_t cost = ENTRY_COST + dir.length();
+
+	for (const std::string& name : names)
+		cost += sizeof(std::string) + name.length();
+
+	return cost;
+}
+
+Cache::Cache(Conn* conn, size_t budget)
+: conn_(conn), budget_(budget), size_(0), hits_(0), misses_(0)
+{
+}
+
+Cache::~Cache()
+{
+	// Nobody is interested in the answers to the WAITs which are still
+	// outstanding any more.
+	for (std::pair<const std::string, std::shared_ptr<Scope> >& it :
+			scopes_)
+	{
+		if (it.second->tag)
+			conn_->Cancel(it.second->tag);
+
+		it.second->cache = 0;
+	}
+}
+
+Status
+Cache::Watch(QString dir)
+{
+	return Watch(dir.toStdString());
+}
+
+Status
+Cache::Watch(std::string dir)
+{
+	std::shared_ptr<Scope> sc;
+
+	while (dir.length() > 1 && dir[dir.length() - 1] == '/')
+		dir.erase(dir.length() - 1);
+
+	if (scopes_.count(dir))
+		return Status();
+
+	sc = std::make_shared<Scope>();
+	sc->cache = this;
+	sc->dir = dir;
+	sc->rev = -1;
+	sc->tag = 0;
+	scopes_[dir] = sc;
+
+	return arm(sc);
+}
+
+Status
+Cache::arm(std::shared_ptr<Scope> sc)
+{
+	Status st;
+
+	if (sc->rev < 0)
+	{
+		int64_t rev;
+
+		st = conn_->Rev(&rev);
+		if (!st.Ok())
+			return st;
+
+		sc->rev = rev;
+	}
+
+	st = conn_->WaitAsync(sc->dir == "/" ? std::string("/**") :
+			sc->dir + "/**", sc->rev + 1,
+			[sc](Status err, Event* ev) {
+		sc->tag = 0;
+		if (sc->cache)
+			sc->cache->apply(sc, err, ev);
+	}, &sc->tag);
+
+	if (!st.Ok())
+		reset(sc);
+
+	return st;
+}
+
+void
+Cache::apply(std::shared_ptr<Scope> sc, Status st, Event* ev)
+{
+	std::map<std::string, File>::iterator fit;
+	std::string path;
+	bool parent = true;
+
+	// We can't tell what we missed, so start over the next time
+	// somebody asks.
+	if (!st.Ok())
+	{
+		reset(sc);
+		return;
+	}
+
+	path = ev->Path();
+	fit = files_.find(path);
+
+	if (fit != files_.end() && scope(path) == sc)
+	{
+		File* f = &fit->second;
+
+		if (ev->Flags() & EVENT_SET)
+		{
+			size_ -= f->cost;
+			f->since = f->rev = ev->Rev();
+			f->body = ev->Body();
+			f->len = f->body.length();
+			f->has_body = true;
+			f->cost = fileCost(path, f->body);
+			size_ += f->cost;
+		}
+		else if (ev->Flags() & EVENT_DEL)
+		{
+			size_ -= f->cost;
+			f->since = ev->Rev();
+			f->rev = 0;
+			f->len = 0;
+			f->body.clear();
+			f->has_body = true;
+			f->cost = fileCost(path, f->body);
+			size_ += f->cost;
+		}
+		else
+			drop(false, path);
+	}
+
+	// Fix up the listings of the directories the file is in. Setting a
+	// file adds its name to its parent and the names of the directories
+	// in between to theirs. Deleting it removes its name from the
+	// parent, but we can't tell whether that emptied any of the
+	// directories further up.
+	while (path.length() > 1)
+	{
+		size_t slash = path.rfind('/');
+		std::string name = path.substr(slash + 1);
+		std::map<std::string, Listing>::iterator dit;
+
+		path.erase(slash ? slash : 1);
+		if (!below(sc->dir, path))
+			break;
+
+		dit = dirs_.find(path);
+		if (dit != dirs_.end() && scope(path) == sc)
+		{
+			Listing* l = &dit->second;
+			std::vector<std::string>::iterator pos =
+				std::lower_bound(l->names.begin(),
+						l->names.end(), name);
+			bool found = pos != l->names.end() && *pos == name;
+
+			if ((ev->Flags() & EVENT_SET) && !found)
+			{
+				l->names.insert(pos, name);
+				l->since = ev->Rev();
+			}
+			else if ((ev->Flags() & EVENT_DEL) && parent && found)
+			{
+				l->names.erase(pos);
+				l->since = ev->Rev();
+			}
+			else if (!(ev->Flags() & EVENT_SET))
+				drop(true, path);
+		}
+
+		dit = dirs_.find(path);
+		if (dit != dirs_.end())
+		{
+			size_ -= dit->second.cost;
+			dit->second.cost = listingCost(path, dit->second.names);
+			size_ += dit->second.cost;
+		}
+
+		parent = false;
+	}
+
+	sc->rev = ev->Rev();
+	shrink();
+	arm(sc);
+}
+
+void
+Cache::reset(std::shared_ptr<Scope> sc)
+{
+	std::map<std::string, File>::iterator fit = files_.begin();
+	std::map<std::string, Listing>::iterator dit = dirs_.begin();
+
+	while (fit != files_.end())
+	{
+		std::string path = (fit++)->first;
+
+		if (scope(path) == sc)
+			drop(false, path);
+	}
+
+	while (dit != dirs_.end())
+	{
+		std::string path = (dit++)->first;
+
+		if (scope(path) == sc)
+			drop(true, path);
+	}
+
+	sc->rev = -1;
+}
+
+std::shared_ptr<Cache::Scope>
+Cache::scope(const std::string& path)
+{
+	std::shared_ptr<Scope> sc;
+
+	for (std::pair<const std::string, std::shared_ptr<Scope> >& it :
+			scopes_)
+		if (below(it.first, path) &&
+				(!sc || it.first.length() > sc->dir.length()))
+			sc = it.second;
+
+	return sc;
+}
+
+Cache::File*
+Cache::file(std::shared_ptr<Scope> sc, const std::string& path, int64_t rev,
+		bool body, File* tmp, Status* st)
+{
+	std::map<std::string, File>::iterator it = files_.find(path);
+	int64_t at = sc->rev;
+	std::string buf;
+	int64_t filerev;
+	int len;
+	File f;
+
+	if (it != files_.end() && (it->second.has_body || !body))
+	{
+		// The cached entry doesn't cover that revision; the caller
+		// has to ask the server.
+		if (rev > sc->rev || rev < it->second.since)
+		{
+			misses_++;
+			return 0;
+		}
+
+		hits_++;
+		touch(it->second.lru);
+		return &it->second;
+	}
+
+	misses_++;
+
+	// Entries are always fetched at the revision of the scope, so that
+	// the changes which come in later apply to them.
+	if (rev > sc->rev)
+		return 0;
+
+	if (body)
+		*st = conn_->Get(path, &at, &buf, &filerev);
+	else
+		*st = conn_->Stat(path, &at, &len, &filerev);
+
+	if (!st->Ok())
+		return 0;
+
+	f.since = filerev > 0 ? filerev : at;
+	f.rev = filerev;
+	f.len = body ? buf.length() : len;
+	f.has_body = body;
+	f.body.swap(buf);
+	f.cost = fileCost(path, f.body);
+
+	// Changes which arrived in the meantime weren't applied to what we
+	// just read, and directories aren't cached as files. Still, what we
+	// read answers the caller's question if it covers the revision.
+	if (at != sc->rev || filerev < 0 || f.cost > budget_)
+	{
+		if (rev < f.since)
+			return 0;
+
+		std::swap(*tmp, f);
+		return tmp;
+	}
+
+	drop(false, path);
+	lru_.push_front(std::make_pair(false, path));
+	f.lru = lru_.begin();
+	size_ += f.cost;
+	it = files_.insert(std::make_pair(path, File())).first;
+	std::swap(it->second, f);
+	shrink();
+
+	if (rev < it->second.since)
+		return 0;
+
+	return &it->second;
+}
+
+Cache::Listing*
+Cache::listing(std::shared_ptr<Scope> sc, const std::string& dir,
+		int64_t rev, Listing* tmp, Status* st)
+{
+	std::map<std::string, Listing>::iterator it = dirs_.find(dir);
+	Listing l;
+
+	if (it != dirs_.end())
+	{
+		// The cached entry doesn't cover that revision; the caller
+		// has to ask the server.
+		if (rev > sc->rev || rev < it->second.since)
+		{
+			misses_++;
+			return 0;
+		}
+
+		hits_++;
+		touch(it->second.lru);
+		return &it->second;
+	}
+
+	misses_++;
+
+	// Listings are fetched at the revision of the scope, which only
+	// helps if that's what was asked for.
+	if (rev != sc->rev)
+		return 0;
+
+	l.since = sc->rev;
+	*st = conn_->Getdir(dir, l.since, 0, -1, &l.names);
+	if (!st->Ok())
+		return 0;
+
+	// The listing is handed out without being cached if changes arrived
+	// in the meantime, or it doesn't fit.
+	l.cost = listingCost(dir, l.names);
+	if (l.since != sc->rev || l.cost > budget_)
+	{
+		std::swap(*tmp, l);
+		return tmp;
+	}
+
+	lru_.push_front(std::make_pair(true, dir));
+	l.lru = lru_.begin();
+	size_ += l.cost;
+	it = dirs_.insert(std::make_pair(dir, Listing())).first;
+	std::swap(it->second, l);
+	shrink();
+
+	if (rev < it->second.since)
+		return 0;
+
+	return &it->second;
+}
+
+void
+Cache::touch(std::list<std::pair<bool, std::string> >::iterator it)
+{
+	lru_.splice(lru_.begin(), lru_, it);
+}
+
+void
+Cache::shrink()
+{
+	while (size_ > budget_ && !lru_.empty())
+	{
+		std::pair<bool, std::string> victim = lru_.back();
+		drop(victim.first, victim.second);
+	}
+}
+
+void
+Cache::drop(bool dir, const std::string& path)
+{
+	if (dir)
+	{
+		std::map<std::string, Listing>::iterator it = dirs_.find(path);
+
+		if (it == dirs_.end())
+			return;
+
+		size_ -= it->second.cost;
+		lru_.erase(it->second.lru);
+		dirs_.erase(it);
+	}
+	else
+	{
+		std::map<std::string, File>::iterator it = files_.find(path);
+
+		if (it == files_.end())
+			return;
+
+		size_ -= it->second.cost;
+		lru_.erase(it->second.lru);
+		files_.erase(it);
+	}
+}
+
+Status
+Cache::Get(QString file, int64_t* storerev, QByteArray* buf,
+		int64_t* filerev)
+{
+	std::string res;
+	Status st = Get(file.toStdString(), storerev, &res, filerev);
+
+	if (st.Ok())
+	{
+		buf->clear();
+		buf->append(res.c_str(), res.length());
+	}
+
+	return st;
+}
+
+Status
+Cache::Get(std::string path, int64_t* storerev, std::string* buf,
+		int64_t* filerev)
+{
+	std::shared_ptr<Scope> sc = scope(path);
+	File tmp;
+	File* f;
+	Status st;
+
+	if (!sc || (sc->rev < 0 && !arm(sc).Ok()))
+		return conn_->Get(path, storerev, buf, filerev);
+
+	f = file(sc, path, storerev ? *storerev : sc->rev, true, &tmp,
+			&st);
+	if (!st.Ok())
+		return st;
+
+	if (!f)
+		return conn_->Get(path, storerev, buf, filerev);
+
+	if (buf)
+		*buf = f->body;
+
+	if (filerev)
+		*filerev = f->rev;
+
+	return Status();
+}
+
+Status
+Cache::Stat(QString path, int64_t* storerev, int* len, int64_t* filerev)
+{
+	return Stat(path.toStdString(), storerev, len, filerev);
+}
+
+Status
+Cache::Stat(std::string path, int64_t* storerev, int* len, int64_t* filerev)
+{
+	std::shared_ptr<Scope> sc = scope(path);
+	File tmp;
+	File* f;
+	Status st;
+
+	if (!sc || (sc->rev < 0 && !arm(sc).Ok()))
+		return conn_->Stat(path, storerev, len, filerev);
+
+	f = file(sc, path, storerev ? *storerev : sc->rev, false, &tmp,
+			&st);
+	if (!st.Ok())
+		return st;
+
+	if (!f)
+		return conn_->Stat(path, storerev, len, filerev);
+
+	if (len)
+		*len = f->len;
+
+	if (filerev)
+		*filerev = f->rev;
+
+	return Status();
+}
+
+Status
+Cache::Getdir(QString dir, int64_t rev, int32_t off, int lim,
+		QVector<QString>* names)
+{
+	std::vector<std::string> res;
+	Status st = Getdir(dir.toStdString(), rev, off, lim, &res);
+
+	if (!st.Ok())
+		return st;
+
+	names->clear();
+
+	for (const std::string& name : res)
+		names->push_back(QString(name.c_str()));
+
+	return Status();
+}
+
+Status
+Cache::Getdir(std::string dir, int64_t rev, int32_t off, int lim,
+		std::vector<std::string>* names)
+{
+	std::shared_ptr<Scope> sc = scope(dir);
+	Listing tmp;
+	Listing* l;
+	size_t end;
+	Status st;
+
+	if (!sc || (sc->rev < 0 && !arm(sc).Ok()))
+		return conn_->Getdir(dir, rev, off, lim, names);
+
+	l = listing(sc, dir, rev, &tmp, &st);
+	if (!st.Ok())
+		return st;
+
+	if (!l)
+		return conn_->Getdir(dir, rev, off, lim, names);
+
+	names->clear();
+
+	if ((size_t) off >= l->names.size())
+		return Status();
+
+	end = l->names.size();
+	if (lim >= 0 && off + (size_t) lim < end)
+		end = off + lim;
+
+	names->assign(l->names.begin() + off, l->names.begin() + end);
+
+	return Status();
+}
+
+int64_t
+Cache::Rev(QString path)
+{
+	return Rev(path.toStdString());
+}
+
+int64_t
+Cache::Rev(std::string path)
+{
+	std::shared_ptr<Scope> sc = scope(path);
+
+	return sc ? sc->rev : -1;
+}
+
+Status
+Cache::Poll(int timeout)
+{
+	return conn_->Poll(timeout);
+}
+
+uint64_t
+Cache::Hits()
+{
+	return hits_;
+}
+
+uint64_t
+Cache::Misses()
+{
+	return misses_;
+}
+
+size_t
+Cache::Size()
+{
+	return size_;
+}
+
+}  // namespace doozer
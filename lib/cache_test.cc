@@ -0,0 +1,274 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <poll.h>
+
+#include <string>
+#include <vector>
+#include <QtCore/QString>
+#include <gtest/gtest.h>
+
+#include "doozer.h"
+#include "fakeserver.h"
+
+namespace doozer {
+namespace {
+
+// Revision the server is at when the cache starts watching.
+#define HEAD	10
+
+// Serves the files /d/a and /d/b at revision HEAD, and keeps the WAITs for
+// the test to answer.
+bool
+serve(FakeServer* srv, const ref::Request& req)
+{
+	static const char* const names[] = { "a", "b" };
+	ref::Response res;
+
+	res.set_tag(req.tag());
+
+	switch (req.verb())
+	{
+	case ref::Request::REV:
+		res.set_rev(HEAD);
+		break;
+	case ref::Request::GET:
+		res.set_rev(3);
+		res.set_value("one");
+		break;
+	case ref::Request::GETDIR:
+		if (req.offset() < 2)
+			res.set_path(names[req.offset()]);
+		else
+			res.set_err_code(ref::Response::RANGE);
+		break;
+	default:
+		return false;
+	}
+
+	srv->Reply(res);
+	return true;
+}
+
+// Answers the WAIT "req" with a change of "path" at revision "rev".
+ref::Response
+event(const ref::Request& req, int64_t rev, const std::string& path,
+		int flags)
+{
+	ref::Response res;
+
+	res.set_tag(req.tag());
+	res.set_rev(rev);
+	res.set_path(path);
+	res.set_value("two");
+	res.set_flags(flags);
+	return res;
+}
+
+// Polls "cache" until a WAIT has been taken from "srv".
+bool
+take(Cache* cache, FakeServer* srv, ref::Request* req)
+{
+	for (int i = 0; i < 100; i++)
+	{
+		if (srv->Take(req, 20))
+			return true;
+
+		cache->Poll(0);
+	}
+
+	return false;
+}
+
+// Polls "cache" until the changes up to "rev" have been applied to "dir".
+void
+poll(Cache* cache, const std::string& dir, int64_t rev)
+{
+	for (int i = 0; cache->Rev(dir) != rev && i < 100; i++)
+		ASSERT_TRUE(cache->Poll(20).Ok());
+
+	ASSERT_EQ(rev, cache->Rev(dir));
+}
+
+TEST(CacheTest, ChangesReplaceCachedFiles)
+{
+	FakeServer srv(serve);
+	Conn conn(srv.Uri(), std::string());
+	Cache cache(&conn, 1 << 20);
+	std::string dir = "/d";
+	std::string file = "/d/a";
+	std::string body;
+	int64_t rev, frev;
+	ref::Request req;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+	ASSERT_TRUE(cache.Watch(dir).Ok());
+	EXPECT_EQ(HEAD, cache.Rev(file));
+	ASSERT_TRUE(take(&cache, &srv, &req));
+	EXPECT_EQ(ref::Request::WAIT, req.verb());
+	EXPECT_EQ("/d/**", req.path());
+	EXPECT_EQ(HEAD + 1, req.rev());
+
+	ASSERT_TRUE(cache.Get(file, 0, &body, &frev).Ok());
+	EXPECT_EQ("one", body);
+	EXPECT_EQ(3, frev);
+	ASSERT_TRUE(cache.Get(file, 0, &body, &frev).Ok());
+	EXPECT_EQ("one", body);
+	EXPECT_EQ(1, srv.Count(ref::Request::GET));
+	EXPECT_EQ(1u, cache.Hits());
+
+	// The new contents come with the change.
+	srv.Reply(event(req, HEAD + 1, file, 4));
+	poll(&cache, dir, HEAD + 1);
+
+	ASSERT_TRUE(cache.Get(file, 0, &body, &frev).Ok());
+	EXPECT_EQ("two", body);
+	EXPECT_EQ(HEAD + 1, frev);
+	EXPECT_EQ(1, srv.Count(ref::Request::GET));
+
+	// The cache no longer knows what the file was before.
+	rev = HEAD;
+	ASSERT_TRUE(cache.Get(file, &rev, &body, &frev).Ok());
+	EXPECT_EQ("one", body);
+	EXPECT_EQ(2, srv.Count(ref::Request::GET));
+}
+
+TEST(CacheTest, ChangesUpdateListings)
+{
+	FakeServer srv(serve);
+	Conn conn(srv.Uri(), std::string());
+	Cache cache(&conn, 1 << 20);
+	std::string dir = "/d";
+	std::vector<std::string> names;
+	ref::Request req;
+	uint64_t misses;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+	ASSERT_TRUE(cache.Watch(dir).Ok());
+	ASSERT_TRUE(cache.Getdir(dir, HEAD, 0, -1, &names).Ok());
+	EXPECT_EQ((std::vector<std::string> { "a", "b" }), names);
+	misses = cache.Misses();
+
+	ASSERT_TRUE(take(&cache, &srv, &req));
+	srv.Reply(event(req, HEAD + 1, "/d/c", 4));
+	poll(&cache, dir, HEAD + 1);
+
+	ASSERT_TRUE(cache.Getdir(dir, HEAD + 1, 0, -1, &names).Ok());
+	EXPECT_EQ((std::vector<std::string> { "a", "b", "c" }), names);
+
+	ASSERT_TRUE(take(&cache, &srv, &req));
+	EXPECT_EQ(HEAD + 2, req.rev());
+	srv.Reply(event(req, HEAD + 2, "/d/a", 8));
+	poll(&cache, dir, HEAD + 2);
+
+	ASSERT_TRUE(cache.Getdir(dir, HEAD + 2, 0, -1, &names).Ok());
+	EXPECT_EQ((std::vector<std::string> { "b", "c" }), names);
+	EXPECT_EQ(misses, cache.Misses());
+	EXPECT_EQ(2u, cache.Hits());
+}
+
+TEST(CacheTest, LostWatchDropsEverything)
+{
+	FakeServer srv(serve);
+	Conn conn(srv.Uri(), std::string());
+	Cache cache(&conn, 1 << 20);
+	std::string dir = "/d";
+	std::string file = "/d/a";
+	std::string body;
+	ref::Request req;
+	ref::Response res;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+	ASSERT_TRUE(cache.Watch(dir).Ok());
+	ASSERT_TRUE(cache.Get(file, 0, &body, 0).Ok());
+	EXPECT_LT(0u, cache.Size());
+
+	// Changes may have been missed, so nothing cached can be trusted.
+	ASSERT_TRUE(take(&cache, &srv, &req));
+	res.set_tag(req.tag());
+	res.set_err_code(ref::Response::TOO_LATE);
+	srv.Reply(res);
+	poll(&cache, dir, -1);
+	EXPECT_EQ(0u, cache.Size());
+
+	// Watching starts over with the next read.
+	ASSERT_TRUE(cache.Get(file, 0, &body, 0).Ok());
+	EXPECT_EQ("one", body);
+	EXPECT_EQ(2, srv.Count(ref::Request::REV));
+	EXPECT_EQ(2, srv.Count(ref::Request::GET));
+	EXPECT_EQ(HEAD, cache.Rev(dir));
+}
+
+TEST(CacheTest, EntriesTooLargeAreFetchedOnce)
+{
+	FakeServer srv(serve);
+	Conn conn(srv.Uri(), std::string());
+	Cache cache(&conn, 1);
+	std::string dir = "/d";
+	std::string file = "/d/a";
+	std::vector<std::string> names;
+	std::string body;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+	ASSERT_TRUE(cache.Watch(dir).Ok());
+
+	// Nothing fits, but what was read is passed on all the same.
+	ASSERT_TRUE(cache.Get(file, 0, &body, 0).Ok());
+	EXPECT_EQ("one", body);
+	EXPECT_EQ(1, srv.Count(ref::Request::GET));
+
+	ASSERT_TRUE(cache.Getdir(dir, HEAD, 0, -1, &names).Ok());
+	EXPECT_EQ((std::vector<std::string> { "a", "b" }), names);
+	EXPECT_EQ(0u, cache.Size());
+}
+
+TEST(CacheTest, DestroyedCacheStopsWatching)
+{
+	FakeServer srv(serve);
+	Conn conn(srv.Uri(), std::string());
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+
+	{
+		Cache cache(&conn, 1 << 20);
+
+		ASSERT_TRUE(cache.Watch(std::string("/d")).Ok());
+		EXPECT_TRUE(conn.Interest() & POLLIN);
+	}
+
+	// The connection isn't waiting for the WAIT's answer any more.
+	EXPECT_FALSE(conn.Interest() & POLLIN);
+}
+
+}  // namespace
+}  // namespace doozer
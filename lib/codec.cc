@@ -0,0 +1,357 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <algorithm>
+#include <string>
+
+#include "codec.h"
+
+namespace doozer {
+
+namespace {
+
+// Wire types used by msg.proto.
+enum {
+	WIRE_VARINT = 0,
+	WIRE_FIXED64 = 1,
+	WIRE_BYTES = 2,
+	WIRE_FIXED32 = 5,
+};
+
+void
+putVarint(std::string* out, uint64_t v)
+{
+	char buf[10];
+	int n = 0;
+
+	while (v >= 0x80)
+	{
+		buf[n++] = (char) (v | 0x80);
+		v >>= 7;
+	}
+	buf[n++] = (char) v;
+
+	out->append(buf, n);
+}
+
+// Only good for field numbers below 16, which is all Request has.
+void
+putKey(std::string* out, int field, int type)
+{
+	out->push_back((char) (field << 3 | type));
+}
+
+void
+putBytes(std::string* out, int field, const std::string& s)
+{
+	putKey(out, field, WIRE_BYTES);
+	putVarint(out, s.length());
+	out->append(s);
+}
+
+// Decodes the varint at "*p", which must be before "end", and advances
+// "*p" past it.
+bool
+getVarint(const uint8_t** p, const uint8_t* end, uint64_t* v)
+{
+	uint64_t res = 0;
+	int shift;
+
+	// Single byte values (tags, verbs, error codes) are the common case.
+	if (*p < end && **p < 0x80)
+	{
+		*v = *(*p)++;
+		return true;
+	}
+
+	for (shift = 0; shift < 64 && *p < end; shift += 7)
+	{
+		uint8_t b = *(*p)++;
+
+		res |= (uint64_t) (b & 0x7f) << shift;
+		if (b < 0x80)
+		{
+			*v = res;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool
+getBytes(const uint8_t** p, const uint8_t* end, std::string* s)
+{
+	uint64_t len;
+
+	if (!getVarint(p, end, &len) || len > (uint64_t) (end - *p))
+		return false;
+
+	s->assign((const char*) *p, len);
+	*p += len;
+	return true;
+}
+
+}  // namespace
+
+Request::Request()
+: has_(0), tag_(0), verb_(GET), other_tag_(0), offset_(0), rev_(0)
+{
+}
+
+void
+Request::AppendToString(std::string* out) const
+{
+	// Fields are written in field number order, as protoc does.
+	// Negative numbers are sign extended to 64 bit, as for int32 fields.
+	if (has_ & kTag)
+	{
+		putKey(out, 1, WIRE_VARINT);
+		putVarint(out, (int64_t) tag_);
+	}
+	if (has_ & kVerb)
+	{
+		putKey(out, 2, WIRE_VARINT);
+		putVarint(out, (int64_t) verb_);
+	}
+	if (has_ & kPath)
+		putBytes(out, 4, path_);
+	if (has_ & kValue)
+		putBytes(out, 5, value_);
+	if (has_ & kOtherTag)
+	{
+		putKey(out, 6, WIRE_VARINT);
+		putVarint(out, (int64_t) other_tag_);
+	}
+	if (has_ & kOffset)
+	{
+		putKey(out, 7, WIRE_VARINT);
+		putVarint(out, (int64_t) offset_);
+	}
+	if (has_ & kRev)
+	{
+		putKey(out, 9, WIRE_VARINT);
+		putVarint(out, rev_);
+	}
+}
+
+std::string
+Request::SerializeAsString() const
+{
+	std::string out;
+
+	out.reserve(32 + path_.length() + value_.length());
+	AppendToString(&out);
+	return out;
+}
+
+Response::Response()
+{
+	Clear();
+}
+
+void
+Response::Clear()
+{
+	tag_ = 0;
+	flags_ = 0;
+	rev_ = 0;
+	path_.clear();
+	value_.clear();
+	len_ = 0;
+	has_err_code_ = false;
+	err_code_ = OTHER;
+	has_err_detail_ = false;
+	err_detail_.clear();
+}
+
+void
+Response::Swap(Response* other)
+{
+	std::swap(tag_, other->tag_);
+	std::swap(flags_, other->flags_);
+	std::swap(rev_, other->rev_);
+	path_.swap(other->path_);
+	value_.swap(other->value_);
+	std::swap(len_, other->len_);
+	std::swap(has_err_code_, other->has_err_code_);
+	std::swap(err_code_, other->err_code_);
+	std::swap(has_err_detail_, other->has_err_detail_);
+	err_detail_.swap(other->err_detail_);
+}
+
+bool
+Response::ParseFromArray(const void* data, int len)
+{
+	const uint8_t* p = (const uint8_t*) data;
+	const uint8_t* end = p + len;
+	uint64_t key, v;
+
+	Clear();
+
+	while (p < end)
+	{
+		if (!getVarint(&p, end, &key))
+			return false;
+
+		switch (key)
+		{
+		case 1 << 3 | WIRE_VARINT:
+			if (!getVarint(&p, end, &v))
+				return false;
+			tag_ = (int32_t) v;
+			break;
+		case 2 << 3 | WIRE_VARINT:
+			if (!getVarint(&p, end, &v))
+				return false;
+			flags_ = (int32_t) v;
+			break;
+		case 3 << 3 | WIRE_VARINT:
+			if (!getVarint(&p, end, &v))
+				return false;
+			rev_ = (int64_t) v;
+			break;
+		case 5 << 3 | WIRE_BYTES:
+			if (!getBytes(&p, end, &path_))
+				return false;
+			break;
+		case 6 << 3 | WIRE_BYTES:
+			if (!getBytes(&p, end, &value_))
+				return false;
+			break;
+		case 8 << 3 | WIRE_VARINT:
+			if (!getVarint(&p, end, &v))
+				return false;
+			len_ = (int32_t) v;
+			break;
+		case 100 << 3 | WIRE_VARINT:
+			if (!getVarint(&p, end, &v))
+				return false;
+			// Like the generated code, ignore codes which aren't
+			// in msg.proto.
+			if (!Response_Err_IsValid((int32_t) v))
+				break;
+			has_err_code_ = true;
+			err_code_ = (Err) v;
+			break;
+		case 101 << 3 | WIRE_BYTES:
+			if (!getBytes(&p, end, &err_detail_))
+				return false;
+			has_err_detail_ = true;
+			break;
+		default:
+			// Skip fields we don't know about.
+			switch (key & 7)
+			{
+			case WIRE_VARINT:
+				if (!getVarint(&p, end, &v))
+					return false;
+				break;
+			case WIRE_FIXED64:
+				if (end - p < 8)
+					return false;
+				p += 8;
+				break;
+			case WIRE_BYTES:
+				if (!getVarint(&p, end, &v) ||
+						v > (uint64_t) (end - p))
+					return false;
+				p += v;
+				break;
+			case WIRE_FIXED32:
+				if (end - p < 4)
+					return false;
+				p += 4;
+				break;
+			default:
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool
+Response_Err_IsValid(int value)
+{
+	switch (value)
+	{
+	case Response_Err_OTHER:
+	case Response_Err_TAG_IN_USE:
+	case Response_Err_UNKNOWN_VERB:
+	case Response_Err_READONLY:
+	case Response_Err_TOO_LATE:
+	case Response_Err_REV_MISMATCH:
+	case Response_Err_BAD_PATH:
+	case Response_Err_MISSING_ARG:
+	case Response_Err_RANGE:
+	case Response_Err_NOTDIR:
+	case Response_Err_ISDIR:
+	case Response_Err_NOENT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+const std::string&
+Response_Err_Name(Response_Err code)
+{
+	static const struct {
+		Response_Err code;
+		std::string name;
+	} names[] = {
+		{ Response_Err_OTHER, "OTHER" },
+		{ Response_Err_TAG_IN_USE, "TAG_IN_USE" },
+		{ Response_Err_UNKNOWN_VERB, "UNKNOWN_VERB" },
+		{ Response_Err_READONLY, "READONLY" },
+		{ Response_Err_TOO_LATE, "TOO_LATE" },
+		{ Response_Err_REV_MISMATCH, "REV_MISMATCH" },
+		{ Response_Err_BAD_PATH, "BAD_PATH" },
+		{ Response_Err_MISSING_ARG, "MISSING_ARG" },
+		{ Response_Err_RANGE, "RANGE" },
+		{ Response_Err_NOTDIR, "NOTDIR" },
+		{ Response_Err_ISDIR, "ISDIR" },
+		{ Response_Err_NOENT, "NOENT" },
+	};
+	static const std::string unknown;
+
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+		if (names[i].code == code)
+			return names[i].name;
+
+	return unknown;
+}
+
+}  // namespace doozer
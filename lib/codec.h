@@ -0,0 +1,189 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DOOZER_LIB_CODEC_H
+#define DOOZER_LIB_CODEC_H 1
+
+// Hand written encoder and decoder for the messages of msg.proto, used
+// instead of the protoc generated code when configured with
+// --enable-fast-codec. Only the parts of the generated interface which
+// libdoozer uses are provided.
+
+#include <stdint.h>
+#include <string>
+
+namespace doozer {
+
+// See Request in msg.proto.
+class Request {
+public:
+	enum Verb {
+		GET      = 1,
+		SET      = 2,
+		DEL      = 3,
+		REV      = 5,
+		WAIT     = 6,
+		NOP      = 7,
+		WALK     = 9,
+		GETDIR   = 14,
+		STAT     = 16,
+		ACCESS   = 99,
+	};
+
+	Request();
+
+	void set_tag(int32_t tag) { tag_ = tag; has_ |= kTag; }
+	void set_verb(Verb verb) { verb_ = verb; has_ |= kVerb; }
+	void set_path(const std::string& path) { path_ = path; has_ |= kPath; }
+	void set_value(const std::string& value)
+	{
+		value_ = value;
+		has_ |= kValue;
+	}
+	void set_value(const char* value, size_t len)
+	{
+		value_.assign(value, len);
+		has_ |= kValue;
+	}
+	void set_other_tag(int32_t tag) { other_tag_ = tag; has_ |= kOtherTag; }
+	void set_offset(int32_t offset) { offset_ = offset; has_ |= kOffset; }
+	void set_rev(int64_t rev) { rev_ = rev; has_ |= kRev; }
+
+	// Appends the wire encoding of the message to "out".
+	void AppendToString(std::string* out) const;
+	std::string SerializeAsString() const;
+
+private:
+	enum {
+		kTag      = 1 << 0,
+		kVerb     = 1 << 1,
+		kPath     = 1 << 2,
+		kValue    = 1 << 3,
+		kOtherTag = 1 << 4,
+		kOffset   = 1 << 5,
+		kRev      = 1 << 6,
+	};
+
+	uint32_t has_;
+	int32_t tag_;
+	Verb verb_;
+	std::string path_;
+	std::string value_;
+	int32_t other_tag_;
+	int32_t offset_;
+	int64_t rev_;
+};
+
+// See Response.Err in msg.proto.
+enum Response_Err {
+	Response_Err_OTHER        = 127,
+	Response_Err_TAG_IN_USE   = 1,
+	Response_Err_UNKNOWN_VERB = 2,
+	Response_Err_READONLY     = 3,
+	Response_Err_TOO_LATE     = 4,
+	Response_Err_REV_MISMATCH = 5,
+	Response_Err_BAD_PATH     = 6,
+	Response_Err_MISSING_ARG  = 7,
+	Response_Err_RANGE        = 8,
+	Response_Err_NOTDIR       = 20,
+	Response_Err_ISDIR        = 21,
+	Response_Err_NOENT        = 22,
+};
+
+// Whether "value" is one of the error codes above.
+bool Response_Err_IsValid(int value);
+
+// Returns the name of the error code "code".
+const std::string& Response_Err_Name(Response_Err code);
+
+// See Response in msg.proto.
+class Response {
+public:
+	typedef Response_Err Err;
+	static const Err OTHER        = Response_Err_OTHER;
+	static const Err TAG_IN_USE   = Response_Err_TAG_IN_USE;
+	static const Err UNKNOWN_VERB = Response_Err_UNKNOWN_VERB;
+	static const Err READONLY     = Response_Err_READONLY;
+	static const Err TOO_LATE     = Response_Err_TOO_LATE;
+	static const Err REV_MISMATCH = Response_Err_REV_MISMATCH;
+	static const Err BAD_PATH     = Response_Err_BAD_PATH;
+	static const Err MISSING_ARG  = Response_Err_MISSING_ARG;
+	static const Err RANGE        = Response_Err_RANGE;
+	static const Err NOTDIR       = Response_Err_NOTDIR;
+	static const Err ISDIR        = Response_Err_ISDIR;
+	static const Err NOENT        = Response_Err_NOENT;
+
+	Response();
+
+	int32_t tag() const { return tag_; }
+	int32_t flags() const { return flags_; }
+	int64_t rev() const { return rev_; }
+	const std::string& path() const { return path_; }
+	const std::string& value() const { return value_; }
+	int32_t len() const { return len_; }
+	bool has_err_code() const { return has_err_code_; }
+	Err err_code() const { return err_code_; }
+	bool has_err_detail() const { return has_err_detail_; }
+	const std::string& err_detail() const { return err_detail_; }
+	std::string* mutable_value() { return &value_; }
+	std::string* mutable_err_detail()
+	{
+		has_err_detail_ = true;
+		return &err_detail_;
+	}
+	void set_tag(int32_t tag) { tag_ = tag; }
+	void set_err_code(Err code)
+	{
+		has_err_code_ = true;
+		err_code_ = code;
+	}
+
+	void Clear();
+	void Swap(Response* other);
+
+	// Decodes the "len" bytes at "data". Returns false if they don't
+	// make up a valid message.
+	bool ParseFromArray(const void* data, int len);
+
+private:
+	int32_t tag_;
+	int32_t flags_;
+	int64_t rev_;
+	std::string path_;
+	std::string value_;
+	int32_t len_;
+	bool has_err_code_;
+	Err err_code_;
+	bool has_err_detail_;
+	std::string err_detail_;
+};
+
+}  // namespace doozer
+
+#endif /* DOOZER_LIB_CODEC_H */
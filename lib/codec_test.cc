@@ -0,0 +1,366 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdint.h>
+
+#include <limits>
+#include <string>
+#include <gtest/gtest.h>
+
+#include "codec.h"
+#include "msg_ref.pb.h"
+
+// The hand written codec is checked against the protoc generated code for
+// msg.proto, which is built into the doozer::ref namespace for the
+// purpose.
+
+namespace doozer {
+namespace {
+
+// Wire encoding of a key for "field" of wire type "type".
+std::string
+key(int field, int type)
+{
+	std::string out;
+	uint32_t v = field << 3 | type;
+
+	while (v >= 0x80)
+	{
+		out.push_back((char) (v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((char) v);
+
+	return out;
+}
+
+void
+expectSame(const ref::Response& want, const Response& got)
+{
+	EXPECT_EQ(want.tag(), got.tag());
+	EXPECT_EQ(want.flags(), got.flags());
+	EXPECT_EQ(want.rev(), got.rev());
+	EXPECT_EQ(want.path(), got.path());
+	EXPECT_EQ(want.value(), got.value());
+	EXPECT_EQ(want.len(), got.len());
+	EXPECT_EQ(want.has_err_code(), got.has_err_code());
+	EXPECT_EQ((int) want.err_code(), (int) got.err_code());
+	EXPECT_EQ(want.has_err_detail(), got.has_err_detail());
+	EXPECT_EQ(want.err_detail(), got.err_detail());
+}
+
+ref::Response
+fullResponse()
+{
+	ref::Response res;
+
+	res.set_tag(17);
+	res.set_flags(4);
+	res.set_rev(123456789012LL);
+	res.set_path("/some/path");
+	res.set_value(std::string("va\0lue", 6));
+	res.set_len(6);
+	res.set_err_code(ref::Response::REV_MISMATCH);
+	res.set_err_detail("detail");
+	return res;
+}
+
+TEST(CodecTest, RequestEveryField)
+{
+	Request req;
+	ref::Request want, got;
+
+	req.set_tag(5);
+	req.set_verb(Request::SET);
+	req.set_path("/a/b");
+	req.set_value(std::string("x\0y", 3));
+	req.set_other_tag(9);
+	req.set_offset(3);
+	req.set_rev(42);
+
+	want.set_tag(5);
+	want.set_verb(ref::Request::SET);
+	want.set_path("/a/b");
+	want.set_value(std::string("x\0y", 3));
+	want.set_other_tag(9);
+	want.set_offset(3);
+	want.set_rev(42);
+
+	EXPECT_EQ(want.SerializeAsString(), req.SerializeAsString());
+	ASSERT_TRUE(got.ParseFromString(req.SerializeAsString()));
+	EXPECT_EQ(want.DebugString(), got.DebugString());
+}
+
+TEST(CodecTest, RequestEveryVerb)
+{
+	const int verbs[] = { 1, 2, 3, 5, 6, 7, 9, 14, 16, 99 };
+
+	for (int verb : verbs)
+	{
+		Request req;
+		ref::Request want;
+
+		req.set_verb((Request::Verb) verb);
+		want.set_verb((ref::Request::Verb) verb);
+		EXPECT_EQ(want.SerializeAsString(), req.SerializeAsString());
+	}
+}
+
+TEST(CodecTest, RequestUnsetFieldsAreLeftOut)
+{
+	Request req;
+	ref::Request want;
+
+	EXPECT_EQ("", req.SerializeAsString());
+
+	req.set_path("/only");
+	want.set_path("/only");
+	EXPECT_EQ(want.SerializeAsString(), req.SerializeAsString());
+}
+
+TEST(CodecTest, RequestNegativeAndLargeVarints)
+{
+	const int32_t i32[] = { -1, -300, std::numeric_limits<int32_t>::min(),
+		std::numeric_limits<int32_t>::max(), 127, 128, 16384 };
+	const int64_t i64[] = { -1, std::numeric_limits<int64_t>::min(),
+		std::numeric_limits<int64_t>::max(), 1LL << 35 };
+
+	for (int32_t v : i32)
+	{
+		Request req;
+		ref::Request want;
+
+		req.set_tag(v);
+		req.set_other_tag(v);
+		req.set_offset(v);
+		want.set_tag(v);
+		want.set_other_tag(v);
+		want.set_offset(v);
+		EXPECT_EQ(want.SerializeAsString(), req.SerializeAsString())
+			<< v;
+	}
+
+	for (int64_t v : i64)
+	{
+		Request req;
+		ref::Request want;
+
+		req.set_rev(v);
+		want.set_rev(v);
+		EXPECT_EQ(want.SerializeAsString(), req.SerializeAsString())
+			<< v;
+	}
+}
+
+TEST(CodecTest, RequestLongValue)
+{
+	std::string value(100000, 'v');
+	Request req;
+	ref::Request want;
+
+	value[500] = '\0';
+	req.set_value(value.data(), value.length());
+	want.set_value(value);
+	EXPECT_EQ(want.SerializeAsString(), req.SerializeAsString());
+}
+
+TEST(CodecTest, RequestAppends)
+{
+	Request req;
+	std::string out("prefix");
+
+	req.set_tag(1);
+	req.AppendToString(&out);
+	EXPECT_EQ("prefix" + req.SerializeAsString(), out);
+}
+
+TEST(CodecTest, ResponseEveryField)
+{
+	ref::Response want = fullResponse();
+	std::string data = want.SerializeAsString();
+	Response got;
+
+	ASSERT_TRUE(got.ParseFromArray(data.data(), data.length()));
+	expectSame(want, got);
+}
+
+TEST(CodecTest, ResponseEveryError)
+{
+	for (int code : { 1, 2, 3, 4, 5, 6, 7, 8, 20, 21, 22, 127 })
+	{
+		ref::Response want;
+		std::string data;
+		Response got;
+
+		want.set_err_code((ref::Response::Err) code);
+		data = want.SerializeAsString();
+		ASSERT_TRUE(got.ParseFromArray(data.data(), data.length()));
+		expectSame(want, got);
+		EXPECT_EQ(ref::Response::Err_Name(want.err_code()),
+				Response_Err_Name(got.err_code()));
+	}
+}
+
+TEST(CodecTest, ResponseUnknownErrorIsIgnored)
+{
+	std::string alone = key(100, 0) + std::string("\x09", 1);
+	std::string after = fullResponse().SerializeAsString() + alone;
+	std::string negative = key(100, 0) +
+		std::string("\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01", 10);
+
+	// Codes msg.proto doesn't know neither set the error code nor
+	// replace one which came before.
+	for (const std::string& data : { alone, after, negative })
+	{
+		ref::Response want;
+		Response got;
+
+		ASSERT_TRUE(want.ParseFromString(data));
+		ASSERT_TRUE(got.ParseFromArray(data.data(), data.length()));
+		expectSame(want, got);
+	}
+}
+
+TEST(CodecTest, ResponseNegativeAndLargeVarints)
+{
+	const int64_t values[] = { -1, -2, std::numeric_limits<int32_t>::min(),
+		std::numeric_limits<int64_t>::min(),
+		std::numeric_limits<int64_t>::max(), 1LL << 35 };
+
+	for (int64_t v : values)
+	{
+		ref::Response want;
+		std::string data;
+		Response got;
+
+		want.set_tag((int32_t) v);
+		want.set_flags((int32_t) v);
+		want.set_rev(v);
+		want.set_len((int32_t) v);
+		data = want.SerializeAsString();
+		ASSERT_TRUE(got.ParseFromArray(data.data(), data.length()))
+			<< v;
+		expectSame(want, got);
+	}
+}
+
+TEST(CodecTest, ResponseUnknownFieldsAreSkipped)
+{
+	ref::Response want;
+	std::string data;
+	Response got;
+
+	// A field of every wire type, before, between and after known ones.
+	data += key(50, 0) + std::string("\xff\xff\x03", 3);
+	data += want.SerializeAsString();
+	data += key(51, 1) + std::string(8, '\x01');
+	data += fullResponse().SerializeAsString();
+	data += key(52, 2) + std::string("\x03" "abc", 4);
+	data += key(53, 5) + std::string(4, '\x02');
+	data += key(7, 0) + std::string("\x01", 1);
+
+	ASSERT_TRUE(want.ParseFromString(data));
+	ASSERT_TRUE(got.ParseFromArray(data.data(), data.length()));
+	expectSame(want, got);
+}
+
+TEST(CodecTest, ResponseLastValueWins)
+{
+	ref::Response first, second, want;
+	std::string data;
+	Response got;
+
+	first.set_tag(1);
+	first.set_path("/first");
+	second.set_tag(2);
+	second.set_path("/second");
+	data = first.SerializeAsString() + second.SerializeAsString();
+
+	ASSERT_TRUE(want.ParseFromString(data));
+	ASSERT_TRUE(got.ParseFromArray(data.data(), data.length()));
+	expectSame(want, got);
+}
+
+TEST(CodecTest, ResponseTruncated)
+{
+	std::string data = fullResponse().SerializeAsString();
+
+	// Cut off at a field boundary, a message is just shorter; anywhere
+	// else it is broken. The codec has to agree on which is which.
+	for (size_t n = 0; n < data.length(); n++)
+	{
+		ref::Response want;
+		Response got;
+		bool ok = want.ParseFromArray(data.data(), n);
+
+		ASSERT_EQ(ok, got.ParseFromArray(data.data(), n)) << n;
+		if (ok)
+			expectSame(want, got);
+	}
+}
+
+TEST(CodecTest, ResponseOverlongVarint)
+{
+	std::string data = key(1, 0) + std::string(10, '\xff') + "\x01";
+	ref::Response want;
+	Response got;
+
+	EXPECT_EQ(want.ParseFromString(data),
+			got.ParseFromArray(data.data(), data.length()));
+}
+
+TEST(CodecTest, ResponseLengthPastEnd)
+{
+	std::string data = key(6, 2) + std::string("\x10" "short", 6);
+	Response got;
+
+	EXPECT_FALSE(got.ParseFromArray(data.data(), data.length()));
+}
+
+TEST(CodecTest, ResponseSwapAndClear)
+{
+	ref::Response want = fullResponse();
+	std::string data = want.SerializeAsString();
+	Response a, b;
+
+	ASSERT_TRUE(a.ParseFromArray(data.data(), data.length()));
+	b.Swap(&a);
+	expectSame(want, b);
+	expectSame(ref::Response(), a);
+
+	b.Clear();
+	expectSame(ref::Response(), b);
+}
+
+}  // namespace
+}  // namespace doozer
@@ -32,7 +32,12 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <arpa/inet.h>
+#include <poll.h>
+#include <string.h>
 
+#include <chrono>
+#include <deque>
+#include <limits>
 #include <string>
 #include <QtCore/QProcessEnvironment>
 #include <QtCore/QString>
@@ -40,15 +45,55 @@
 #include <QtCore/QUrl>
 #include <QtCore/QVector>
 
-#include <QtNetwork/QTcpSocket>
-
-#include <google/protobuf/message.h>
-
-#include "msg.pb.h"
+#include "msg.h"
 #include "doozer.h"
+#include "transport.h"
+
+// Smallest number of bytes read from the socket at a time.
+#define RECV_MIN	4096
 
 namespace doozer {
 
+// The tag handed out after "tag", wrapping around to 1 after the largest
+// one rather than overflowing.
+static int32_t
+followingTag(int32_t tag)
+{
+	return tag < std::numeric_limits<int32_t>::max() ? tag + 1 : 1;
+}
+
+// State of a range of requests started by fetchRangeAsync().
+struct Conn::RangeState {
+	RangeState(Request* r, int32_t off, int l,
+			std::function<bool (Response*)> f,
+			std::function<void (Status)> d)
+	: req(*r), next(off), deliver(off),
+	  stop(std::numeric_limits<int32_t>::max()), lim(l), inflight(0),
+	  fn(f), done(d)
+	{
+	}
+
+	~RangeState()
+	{
+		for (std::pair<int32_t, Response*> it : ready)
+			delete it.second;
+	}
+
+	Request req;
+	int32_t next;		// Next offset to request.
+	int32_t deliver;	// Next offset to pass to "fn".
+	int32_t stop;		// First offset not to pass to "fn".
+	int lim;		// Offsets left to request, if not negative.
+	int inflight;
+	Status err;
+
+	// Responses which arrived before the ones preceding them, by offset.
+	std::map<int32_t, Response*> ready;
+
+	std::function<bool (Response*)> fn;
+	std::function<void (Status)> done;
+};
+
 Conn::Conn()
 {
 	QString uri = QProcessEnvironment::systemEnvironment()
@@ -56,51 +101,75 @@ Conn::Conn()
 	QString buri = QProcessEnvironment::systemEnvironment()
 		.value("DOOZER_BOOT_URI");
 
-	init(uri, buri);
+	init(uri, buri, CONNECT_NOW);
+}
+
+Conn::Conn(ConnectMode mode)
+{
+	QString uri = QProcessEnvironment::systemEnvironment()
+		.value("DOOZER_URI");
+	QString buri = QProcessEnvironment::systemEnvironment()
+		.value("DOOZER_BOOT_URI");
+
+	init(uri, buri, mode);
 }
 
 Conn::Conn(std::string addr)
 {
 	QString qaddr = QString(addr.c_str());
 
-	init(doozer_uri_prefix + "ca=" + qaddr, QString());
+	init(doozer_uri_prefix + "ca=" + qaddr, QString(), CONNECT_NOW);
 }
 
 Conn::Conn(QString addr)
 {
-	init(doozer_uri_prefix + "ca=" + addr, QString());
+	init(doozer_uri_prefix + "ca=" + addr, QString(), CONNECT_NOW);
 }
 
-Conn::Conn(std::string uri, std::string boot_uri)
+Conn::Conn(std::string uri, std::string boot_uri, ConnectMode mode)
 {
-	init(QString(uri.c_str()), QString(boot_uri.c_str()));
+	init(QString(uri.c_str()), QString(boot_uri.c_str()), mode);
 }
 
-Conn::Conn(QString uri, QString boot_uri)
+Conn::Conn(QString uri, QString boot_uri, ConnectMode mode)
 {
-	init(uri, boot_uri);
+	init(uri, boot_uri, mode);
 }
 
 Conn::~Conn()
 {
-	conn_->disconnectFromHost();
-	conn_->deleteLater();
+	for (std::pair<int32_t, Response*> it : pending_)
+		delete it.second;
+
+	abortDial();
+
+	if (conn_)
+	{
+		conn_->Close();
+		delete conn_;
+	}
 }
 
 void
-Conn::init(QString uri, QString buri)
+Conn::init(QString uri, QString buri, ConnectMode mode)
 {
-	QString host, port;
-	QStringList addrs;
 	QUrl p;
 
-	error_ = 0;
+	error_ = Status();
 	valid_ = false;
 	timeout_ = 30000;
+	window_ = 32;
+	conn_ = 0;
+	addr_ = 0;
+	cached_ = false;
+	dialed_ = false;
+	authing_ = false;
+	next_tag_ = 1;
+	rpos_ = 0;
 
 	if (!uri.startsWith(doozer_uri_prefix))
 	{
-		error_ = new Error(QString("Invalid URI (wrong prefix)"));
+		error_ = Status(QString("Invalid URI (wrong prefix)"));
 		return;
 	}
 
@@ -109,106 +178,1098 @@ Conn::init(QString uri, QString buri)
 	QString name = p.queryItemValue("cn");
 	if (name.length() > 0 && buri.length() > 0)
 	{
-		init(buri, QString());
-		if (!IsValid())
-			return;
-
-		// TODO(caoimhe): Do the lookup here.
+		name_ = name;
+		buri_ = buri;
 	}
 	else
 	{
-		addrs = p.allQueryItemValues("ca");
-		if (addrs.isEmpty())
+		for (QString addr : p.allQueryItemValues("ca"))
+			addrs_.append(addr);
+
+		if (addrs_.isEmpty())
 		{
-			error_ = new Error(QString("Invalid URI (no addresses)"));
+			error_ = Status(QString("Invalid URI (no addresses)"));
 			return;
 		}
 	}
 
-	int i = qrand() % addrs.length();
-	int pos = addrs[i].lastIndexOf(':');
-	host = addrs[i].left(pos);
-	port = addrs[i].mid(pos + 1);
+	secret_ = p.queryItemValue("sk");
+
+	if (mode == CONNECT_LAZY)
+		valid_ = true;
+	else
+		establish();
+}
+
+Status
+Conn::establish()
+{
+	if (dialed_)
+		return error_;
+
+	dialed_ = true;
 
-	conn_ = new QTcpSocket();
+	error_ = resolve();
+	if (error_.Ok())
+		error_ = dialing_.empty() ? dial(members()) : finishDial();
 
-	conn_->connectToHost(host, port.toInt());
-	if (!conn_->waitForConnected())
+	// The members we remembered may have moved on; ask the boot
+	// cluster again.
+	if (!error_.Ok() && cached_)
 	{
-		error_ = new Error(conn_->errorString());
-		conn_->deleteLater();
+		error_ = lookup(name_, buri_, true, &addrs_, &cached_);
+		if (error_.Ok())
+			error_ = dial(members());
+	}
+
+	valid_ = error_.Ok();
+
+	// Requests made while connecting in the background won't be
+	// answered.
+	if (!valid_ && !callbacks_.empty())
+	{
+		CallbackMap callbacks;
+
+		forget(&callbacks);
+		fail(callbacks, error_.ToString());
+	}
+
+	return error_;
+}
+
+Status
+Conn::resolve()
+{
+	if (!addrs_.isEmpty())
+		return Status();
+
+	return lookup(name_, buri_, false, &addrs_, &cached_);
+}
+
+void
+Conn::Prewarm()
+{
+	if (dialed_ || !dialing_.empty() || !resolve().Ok())
 		return;
+
+	startDial(members());
+}
+
+std::vector<int>
+Conn::members()
+{
+	std::vector<int> all;
+	int first;
+
+	// Start with a random member, so that ties are broken differently
+	// by every client.
+	first = qrand() % addrs_.size();
+	for (int n = 0; n < addrs_.size(); n++)
+		all.push_back((first + n) % addrs_.size());
+
+	return all;
+}
+
+Status
+Conn::dial(const std::vector<int>& which)
+{
+	startDial(which);
+	return finishDial();
+}
+
+void
+Conn::startDial(const std::vector<int>& which)
+{
+	if (conn_)
+	{
+		conn_->Close();
+		delete conn_;
+		conn_ = 0;
+	}
+
+	abortDial();
+	dial_started_ = std::chrono::steady_clock::now();
+
+	for (int i : which)
+	{
+		int pos = addrs_[i].lastIndexOf(':');
+		Transport* sock = NewTransport();
+
+		sock->Connect(addrs_[i].left(pos),
+				addrs_[i].mid(pos + 1).toInt());
+		dialing_.push_back(std::make_pair(i, sock));
+	}
+}
+
+int
+Conn::checkDial(Status* st, std::vector<int>* fds)
+{
+	size_t i = 0;
+
+	while (i < dialing_.size())
+	{
+		Transport* sock = dialing_[i].second;
+		bool failed;
+
+		if (sock->Connected(&failed))
+			return i;
+
+		if (failed)
+		{
+			*st = Status(sock->Error());
+			delete sock;
+			dialing_.erase(dialing_.begin() + i);
+			continue;
+		}
+
+		if (fds && sock->Descriptor() >= 0)
+			fds->push_back(sock->Descriptor());
+		i++;
+	}
+
+	return -1;
+}
+
+bool
+Conn::awaitDial(std::vector<int>* fds, int timeout, Status* st)
+{
+	std::vector<struct pollfd> pfds;
+	int wait = timeout;
+
+	if (timeout_ >= 0)
+	{
+		int left = timeout_ - std::chrono::duration_cast<
+			std::chrono::milliseconds>(
+					std::chrono::steady_clock::now() -
+					dial_started_).count();
+
+		if (left <= 0)
+		{
+			abortDial();
+			*st = Status(Status::TIMEOUT, "Timed out connecting");
+			return false;
+		}
+
+		if (wait < 0 || wait > left)
+			wait = left;
+	}
+
+	// Qt may not have a socket yet while it looks up the host name.
+	if (fds->size() < dialing_.size())
+		wait = wait < 0 || wait > 10 ? 10 : wait;
+
+	for (int fd : *fds)
+	{
+		struct pollfd pfd;
+
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		pfds.push_back(pfd);
+	}
+
+	poll(pfds.empty() ? 0 : &pfds[0], pfds.size(), wait);
+	return true;
+}
+
+void
+Conn::adopt(int i)
+{
+	addr_ = dialing_[i].first;
+	conn_ = dialing_[i].second;
+	dialing_.erase(dialing_.begin() + i);
+}
+
+void
+Conn::reject()
+{
+	conn_->Close();
+	delete conn_;
+	conn_ = 0;
+	rbuf_.clear();
+	rpos_ = 0;
+
+	// Nothing more will arrive for requests given up on.
+	for (int32_t tag : abandoned_)
+		pending_.erase(tag);
+
+	abandoned_.clear();
+}
+
+void
+Conn::abortDial()
+{
+	for (std::pair<int, Transport*> it : dialing_)
+		delete it.second;
+
+	dialing_.clear();
+}
+
+Status
+Conn::finishDial()
+{
+	Status st(QString("Invalid URI (no addresses)"));
+	int winner;
+
+	// Wait for whichever connection comes up first. Sockets which are
+	// still connecting are poll()ed all together, and the transport gets
+	// to look at those which are ready. Should the member which answered
+	// first not let us in, the others still get their chance.
+	for (;;)
+	{
+		std::vector<int> fds;
+
+		winner = checkDial(&st, &fds);
+		if (winner < 0)
+		{
+			if (dialing_.empty() || !awaitDial(&fds, -1, &st))
+				return st;
+			continue;
+		}
+
+		adopt(winner);
+
+		if (secret_.isEmpty())
+			break;
+
+		st = Access(secret_);
+		if (st.Ok())
+			break;
+
+		reject();
 	}
 
-	QString secret = p.queryItemValue("sk");
-	if (secret.length() > 0)
+	abortDial();
+	return sendQueued();
+}
+
+Status
+Conn::progressDial(int timeout)
+{
+	Status st(QString("Invalid URI (no addresses)"));
+	std::vector<int> fds;
+	CallbackMap callbacks;
+	Request req;
+	int winner;
+
+	winner = checkDial(&st, &fds);
+	if (winner < 0 && !dialing_.empty() && awaitDial(&fds, timeout, &st))
+		winner = checkDial(&st, 0);
+
+	if (winner < 0 && !dialing_.empty())
+		return Status();
+
+	if (winner < 0)
 	{
-		error_ = Access(secret);
+		dialed_ = true;
+		error_ = st;
+		valid_ = false;
+		forget(&callbacks);
+		fail(callbacks, st.ToString());
+		return st;
+	}
+
+	adopt(winner);
+
+	if (secret_.isEmpty())
+		return admitted();
+
+	// The queued requests are held back until we've been let in. If we
+	// aren't, the other members which are still connecting are tried.
+	req.set_verb(Request::ACCESS);
+	req.set_value(secret_.toStdString());
+
+	st = sendAsync(&req, [this](Response* res) {
+		std::string why = res->err_detail();
+		Status st(res);
+		CallbackMap callbacks;
 
-		if (error_)
+		authing_ = false;
+
+		if (st.Ok())
 		{
-			conn_->disconnectFromHost();
-			conn_->deleteLater();
+			admitted();
 			return;
 		}
+
+		reject();
+		if (!dialing_.empty())
+			return;
+
+		dialed_ = true;
+		error_ = st;
+		valid_ = false;
+		forget(&callbacks);
+		fail(callbacks, why.empty() ? st.ToString() : why);
+	});
+
+	if (st.Ok())
+		authing_ = true;
+
+	return st;
+}
+
+Status
+Conn::admitted()
+{
+	CallbackMap callbacks;
+	Status st;
+
+	dialed_ = true;
+	abortDial();
+
+	st = sendQueued();
+	if (!st.Ok())
+	{
+		forget(&callbacks);
+		fail(callbacks, st.ToString());
+		return st;
 	}
 
+	error_ = Status();
 	valid_ = true;
+	return st;
 }
 
-Error*
-Conn::send(const ::google::protobuf::Message& msg)
+Status
+Conn::sendQueued()
 {
-	std::string msgstr = msg.SerializeAsString();
-	uint32_t len = htonl(msgstr.length());
-	QByteArray buf = QByteArray::fromRawData((char*) &len, 4);
+	std::string out;
 
-	buf.push_back(msgstr.c_str());
+	if (queued_.empty())
+		return Status();
 
-	if (conn_->write(buf) != buf.length())
-		return new Error(conn_->errorString());
+	out.swap(queued_);
 
-	if (!conn_->waitForBytesWritten(timeout_))
-		return new Error(QString("Unable to wait for the written byte: ") +
-				conn_->errorString());
+	if (!conn_->Write(out.data(), out.length()) || !conn_->Send())
+		return hangup();
 
-	return 0;
+	return Status();
 }
 
-Error*
-Conn::recv(::google::protobuf::Message* msg)
+Status
+Conn::hangup()
+{
+	// Part of a request may have gone out already, after which the server
+	// can't make sense of anything we send. Reconnect() establishes a new
+	// connection.
+	error_ = Status(conn_->Error());
+	valid_ = false;
+	delete conn_;
+	conn_ = 0;
+	return error_;
+}
+
+void
+Conn::forget(CallbackMap* callbacks)
+{
+	std::map<int32_t, Response*>::iterator it = pending_.begin();
+
+	callbacks->swap(callbacks_);
+
+	// Whoever is waiting for a response synchronously finds an error.
+	while (it != pending_.end())
+	{
+		if (callbacks->count(it->first) || abandoned_.count(it->first))
+		{
+			delete it->second;
+			pending_.erase(it++);
+			continue;
+		}
+
+		if (!it->second)
+		{
+			it->second = new Response();
+			it->second->set_tag(it->first);
+			it->second->set_err_code(Response::OTHER);
+			it->second->mutable_err_detail()->assign(
+					"Connection lost");
+		}
+
+		++it;
+	}
+
+	abandoned_.clear();
+	queued_.clear();
+	authing_ = false;
+	rbuf_.clear();
+	rpos_ = 0;
+}
+
+void
+Conn::fail(const CallbackMap& callbacks, const std::string& why)
+{
+	for (const std::pair<const int32_t, std::function<void (Response*)> >&
+			it : callbacks)
+	{
+		Response res;
+
+		res.set_tag(it.first);
+		res.set_err_code(Response::OTHER);
+		res.mutable_err_detail()->assign(why);
+		it.second(&res);
+	}
+}
+
+Status
+Conn::Reconnect()
+{
+	CallbackMap callbacks;
+	Status st(QString("Invalid URI (no addresses)"));
+
+	// Nothing to lose yet.
+	if (!dialed_ && !conn_)
+		return establish();
+
+	dialed_ = true;
+	forget(&callbacks);
+
+	for (std::pair<int32_t, Response*> it : pending_)
+		delete it.second;
+
+	pending_.clear();
+
+	// Try the address we just lost last.
+	if (addrs_.size() > 1)
+	{
+		std::vector<int> others;
+
+		for (int n = 1; n < addrs_.size(); n++)
+			others.push_back((addr_ + n) % addrs_.size());
+
+		st = dial(others);
+	}
+
+	if (!addrs_.isEmpty() && (!st.Ok() || addrs_.size() == 1))
+		st = dial(std::vector<int>(1, addr_));
+
+	error_ = st;
+	valid_ = st.Ok();
+
+	fail(callbacks, "Connection lost");
+	return st;
+}
+
+void
+Conn::ReconnectAsync()
+{
+	CallbackMap callbacks;
+	std::vector<int> all;
+
+	forget(&callbacks);
+
+	for (std::pair<int32_t, Response*> it : pending_)
+		delete it.second;
+
+	pending_.clear();
+
+	// The address we just lost comes last, though all of them are
+	// dialed at once.
+	for (int n = 1; n <= addrs_.size(); n++)
+		all.push_back((addr_ + n) % addrs_.size());
+
+	if (!all.empty())
+	{
+		startDial(all);
+		dialed_ = false;
+	}
+
+	fail(callbacks, "Connection lost");
+}
+
+Status
+Conn::send(Request* req, int32_t* tag, const char* value, size_t len,
+		bool async)
+{
+	uint32_t framelen;
+
+	// Tag 0 is never handed out, and neither is any tag the server still
+	// considers to be in use.
+	while (pending_.count(next_tag_))
+		next_tag_ = followingTag(next_tag_);
+
+	*tag = next_tag_;
+	next_tag_ = followingTag(next_tag_);
+	req->set_tag(*tag);
+
+	if (!value && len)
+		return Status(QString("Missing value of ") +
+				QString::number(len) + QString(" bytes"));
+
+	// Asynchronous requests don't wait for the connection to come up;
+	// they are queued until it has.
+	if (!conn_ && !dialed_)
+	{
+		if (async)
+			Prewarm();
+
+		if (!async || dialing_.empty())
+		{
+			Status st = establish();
+			if (!st.Ok())
+				return st;
+		}
+	}
+
+	if (!conn_ && dialing_.empty())
+		return Status(QString("Not connected"));
+
+	// Serialize right behind the space for the length prefix, reusing
+	// the buffer from the previous request.
+	wbuf_.assign(4, '\0');
+	req->AppendToString(&wbuf_);
+
+	// The value goes out straight from the caller's memory, as field 5
+	// (length delimited) of the request.
+	if (value)
+	{
+		wbuf_.push_back((char) (5 << 3 | 2));
+		for (size_t v = len; ; v >>= 7)
+		{
+			if (v < 0x80)
+			{
+				wbuf_.push_back((char) v);
+				break;
+			}
+			wbuf_.push_back((char) (v | 0x80));
+		}
+	}
+
+	framelen = htonl(wbuf_.length() - 4 + (value ? len : 0));
+	memcpy(&wbuf_[0], &framelen, 4);
+
+	// Whatever the socket doesn't take right away is sent later on, by
+	// ProcessIO() or Poll() or before waiting for a response.
+	if (!conn_ || authing_)
+	{
+		queued_.append(wbuf_);
+		if (value)
+			queued_.append(value, len);
+	}
+	else if (!conn_->Write(wbuf_.data(), wbuf_.length()) ||
+			(value && len && !conn_->Write(value, len)) ||
+			!conn_->Send())
+		return hangup();
+
+	pending_[*tag] = 0;
+	return Status();
+}
+
+Status
+Conn::recv(int32_t tag, Response* res)
+{
+	std::map<int32_t, Response*>::iterator it = pending_.find(tag);
+	Status st;
+
+	if (it == pending_.end() || abandoned_.count(tag))
+		return Status(QString("No request pending for tag ") +
+				QString::number(tag));
+
+	// Map iterators stay valid while other responses are being filed.
+	while (!it->second)
+	{
+		st = readResponse();
+		if (!st.Ok())
+			return st;
+	}
+
+	res->Swap(it->second);
+	delete it->second;
+	pending_.erase(it);
+
+	return Status();
+}
+
+Status
+Conn::call(Request* req, Response* res, const char* value, size_t len)
+{
+	int32_t tag;
+	Status st = send(req, &tag, value, len);
+
+	if (!st.Ok())
+	{
+		abandon(tag);
+		return st;
+	}
+
+	st = recv(tag, res);
+	if (!st.Ok())
+		abandon(tag);
+
+	return st;
+}
+
+void
+Conn::abandon(int32_t tag)
+{
+	std::map<int32_t, Response*>::iterator it = pending_.find(tag);
+
+	if (it == pending_.end())
+		return;
+
+	callbacks_.erase(tag);
+
+	if (it->second)
+	{
+		delete it->second;
+		pending_.erase(it);
+	}
+	else
+		abandoned_.insert(tag);
+}
+
+Status
+Conn::fetchRange(Request* req, int32_t off, int lim,
+		std::function<bool (Response*)> fn)
+{
+	std::deque<int32_t> inflight;
+	Status st;
+	bool end = false;
+	int32_t tag;
+	Response res;
+
+	for (;;)
+	{
+		// Keep the window filled with the following offsets until we
+		// know where the range ends.
+		while (st.Ok() && !end && lim &&
+				(int) inflight.size() < window_)
+		{
+			req->set_offset(off++);
+			if (lim > 0)
+				lim--;
+
+			st = send(req, &tag);
+			if (!st.Ok())
+				abandon(tag);
+			else
+				inflight.push_back(tag);
+		}
+
+		if (inflight.empty())
+			break;
+
+		tag = inflight.front();
+		inflight.pop_front();
+
+		if (!st.Ok() || end)
+		{
+			abandon(tag);
+			continue;
+		}
+
+		st = recv(tag, &res);
+		if (!st.Ok())
+		{
+			abandon(tag);
+			continue;
+		}
+
+		if (res.has_err_code())
+		{
+			// Running past the last entry is how we find the end.
+			if (res.err_code() == Response::RANGE)
+				end = true;
+			else
+				st = Status(&res);
+			continue;
+		}
+
+		if (!fn(&res))
+			end = true;
+	}
+
+	return st;
+}
+
+Status
+Conn::sendAsync(Request* req, std::function<void (Response*)> done,
+		const char* value, size_t len, int32_t* tagp)
+{
+	int32_t tag;
+	Status st = send(req, &tag, value, len, true);
+
+	if (!st.Ok())
+	{
+		abandon(tag);
+		return st;
+	}
+
+	callbacks_[tag] = done;
+
+	if (tagp)
+		*tagp = tag;
+
+	return Status();
+}
+
+void
+Conn::Cancel(int32_t tag)
+{
+	if (callbacks_.count(tag))
+		abandon(tag);
+}
+
+Status
+Conn::fetchRangeAsync(Request* req, int32_t off, int lim,
+		std::function<bool (Response*)> fn,
+		std::function<void (Status)> done)
+{
+	std::shared_ptr<RangeState> st(new RangeState(req, off, lim, fn,
+				done));
+
+	fillRange(st);
+
+	if (!st->inflight)
+	{
+		if (!st->err.Ok())
+			return st->err;
+
+		// Nothing was asked for.
+		st->done(Status());
+	}
+
+	return Status();
+}
+
+void
+Conn::fillRange(std::shared_ptr<RangeState> st)
+{
+	while (st->err.Ok() && st->lim && st->next < st->stop &&
+			st->inflight < window_)
+	{
+		int32_t off = st->next++;
+
+		if (st->lim > 0)
+			st->lim--;
+
+		st->req.set_offset(off);
+		st->err = sendAsync(&st->req, [this, st, off](Response* res) {
+			rangeResponse(st, off, res);
+		});
+
+		if (st->err.Ok())
+			st->inflight++;
+	}
+}
+
+void
+Conn::rangeResponse(std::shared_ptr<RangeState> st, int32_t off,
+		Response* res)
+{
+	std::map<int32_t, Response*>::iterator it;
+
+	st->inflight--;
+
+	if (st->err.Ok() && off < st->stop)
+	{
+		if (res->has_err_code())
+		{
+			// Running past the last entry is how we find the end.
+			if (res->err_code() == Response::RANGE)
+				st->stop = off;
+			else
+				st->err = Status(res);
+		}
+		else if (off == st->deliver)
+		{
+			if (!st->fn(res))
+				st->stop = off + 1;
+			st->deliver++;
+		}
+		else
+		{
+			st->ready[off] = new Response();
+			st->ready[off]->Swap(res);
+		}
+
+		// Pass on whatever was waiting for this response.
+		while (st->err.Ok() && st->deliver < st->stop &&
+				(it = st->ready.find(st->deliver)) !=
+				st->ready.end())
+		{
+			if (!st->fn(it->second))
+				st->stop = st->deliver + 1;
+
+			delete it->second;
+			st->ready.erase(it);
+			st->deliver++;
+		}
+
+		fillRange(st);
+	}
+
+	if (!st->inflight)
+		st->done(st->err);
+}
+
+Status
+Conn::Poll(int timeout)
+{
+	Status st;
+
+	if (!conn_ && !dialed_ && !dialing_.empty())
+	{
+		st = progressDial(timeout);
+		if (!st.Ok() || !conn_)
+			return st;
+	}
+
+	if (!conn_)
+		return Status(QString("Not connected"));
+
+	if (conn_->Pending() && !conn_->Send())
+		return Status(conn_->Error());
+
+	if (!frameReady() && !conn_->WaitReadable(timeout))
+	{
+		if (!conn_->IsOpen())
+			return Status(conn_->Error());
+
+		return Status();
+	}
+
+	if (!frameReady() || conn_->Available())
+	{
+		st = fill(0);
+		if (!st.Ok())
+			return st;
+	}
+
+	return readFrames();
+}
+
+Status
+Conn::Flush()
+{
+	Status st;
+
+	while (!callbacks_.empty())
+	{
+		st = readResponse();
+		if (!st.Ok())
+			return st;
+	}
+
+	return Status();
+}
+
+int
+Conn::Descriptor()
+{
+	if (conn_)
+		return conn_->Descriptor();
+
+	for (std::pair<int, Transport*> it : dialing_)
+	{
+		if (it.second->Descriptor() >= 0)
+			return it.second->Descriptor();
+	}
+
+	return -1;
+}
+
+int
+Conn::Interest()
+{
+	int events = 0;
+
+	// Connecting is over once the socket becomes writable.
+	if (!conn_)
+		return dialing_.empty() || callbacks_.empty() ? 0 : POLLOUT;
+
+	if (!callbacks_.empty())
+		events |= POLLIN;
+
+	if (conn_->Pending())
+		events |= POLLOUT;
+
+	return events;
+}
+
+Status
+Conn::ProcessIO()
+{
+	Status st;
+
+	if (!conn_ && !dialed_ && !dialing_.empty())
+	{
+		st = progressDial(0);
+		if (!st.Ok() || !conn_)
+			return st;
+	}
+
+	if (!conn_)
+		return Status(QString("Not connected"));
+
+	// Read until the socket runs dry, so edge triggered loops are not
+	// left waiting for data which has already arrived.
+	do
+	{
+		st = Poll(0);
+		if (!st.Ok())
+			return st;
+	}
+	while (conn_ && conn_->Available());
+
+	return st;
+}
+
+Status
+Conn::readResponse()
+{
+	Status st;
+
+	// Requests sent asynchronously may still be waiting for the
+	// connection to come up.
+	if (!conn_ && !dialed_ && !dialing_.empty())
+	{
+		st = establish();
+		if (!st.Ok())
+			return st;
+	}
+
+	if (!conn_)
+		return error_.Ok() ? Status(QString("Not connected")) : error_;
+
+	// Make sure whatever we're waiting for has actually gone out.
+	if (conn_->Pending() && !conn_->Flush(timeout_))
+		return Status(QString("Unable to send request: ") +
+				conn_->Error());
+
+	while (!frameReady())
+	{
+		st = fill(timeout_);
+		if (!st.Ok())
+			return st;
+	}
+
+	return readFrames();
+}
+
+bool
+Conn::frameReady()
 {
-	if (!conn_->bytesAvailable() && !conn_->waitForReadyRead(timeout_))
-		return new Error(QString("Timed out waiting for response (") +
-				conn_->errorString() + QString(")"));
-	QByteArray buf = conn_->read(4);
-	uint32_t* lenp;
 	uint32_t len;
 
-	if (buf.length() != 4)
-		return new Error(conn_->errorString());
+	if (rbuf_.length() - rpos_ < 4)
+		return false;
+
+	memcpy(&len, rbuf_.data() + rpos_, 4);
+	return rbuf_.length() - rpos_ - 4 >= ntohl(len);
+}
+
+Status
+Conn::fill(int timeout)
+{
+	size_t avail = conn_->Available();
+	ssize_t n;
+	size_t used;
+
+	if (!avail)
+	{
+		if (!conn_->WaitReadable(timeout))
+		{
+			std::string why = conn_->Error().toStdString();
+
+			if (!conn_->IsOpen())
+				return Status(QString("Connection lost (") +
+						why.c_str() + QString(")"));
+
+			return Status(Status::TIMEOUT, "Timed out waiting for "
+					"response (" + why + ")");
+		}
+
+		avail = conn_->Available();
+	}
+
+	// Whatever woke us up may also have been the connection going away,
+	// which only a read tells.
+	if (avail < RECV_MIN)
+		avail = RECV_MIN;
 
-	lenp = (uint32_t*) buf.data();
-	len = ntohl(*lenp);
-	msg->Clear();
+	// Move what's left of a partially read frame to the front before
+	// appending, rather than letting the buffer grow forever.
+	if (rpos_ == rbuf_.length())
+	{
+		rbuf_.clear();
+		rpos_ = 0;
+	}
+	else if (rpos_ > rbuf_.length() / 2)
+	{
+		rbuf_.erase(0, rpos_);
+		rpos_ = 0;
+	}
+
+	used = rbuf_.length();
+	rbuf_.resize(used + avail);
+
+	n = conn_->Read(&rbuf_[used], avail);
+	rbuf_.resize(used + (n > 0 ? n : 0));
+
+	if (n < 0)
+		return Status(conn_->Error());
 
-	if (len > 0)
+	return Status();
+}
+
+Status
+Conn::readFrames()
+{
+	// Callbacks may end up in here again while we're dispatching, so
+	// the read position is advanced past each frame before handing it
+	// on.
+	while (frameReady())
 	{
-		if (!conn_->bytesAvailable() &&
-				!conn_->waitForReadyRead(timeout_))
-			return new Error(QString("Timed out waiting for "
-						"response (") +
-					conn_->errorString() + QString(")"));
+		uint32_t len;
+		Response res;
+		bool ok;
+
+		memcpy(&len, rbuf_.data() + rpos_, 4);
+		len = ntohl(len);
 
-		buf = conn_->read(len);
-		if (buf.length() != len)
-			return new Error(conn_->errorString());
+		ok = res.ParseFromArray(rbuf_.data() + rpos_ + 4, len);
+		rpos_ += 4 + len;
 
-		if (!msg->ParseFromArray(buf.data(), buf.length()))
-			return new Error(QString("Error parsing message"));
+		if (!ok)
+			return Status(QString("Error parsing message"));
+
+		dispatch(&res);
 	}
 
-	return 0;
+	return Status();
+}
+
+void
+Conn::dispatch(Response* res)
+{
+	std::map<int32_t, Response*>::iterator it = pending_.find(res->tag());
+	std::map<int32_t, std::function<void (Response*)> >::iterator cb =
+		callbacks_.find(res->tag());
+
+	// Responses nobody asked for, or nobody is waiting for any more,
+	// are dropped.
+	if (it == pending_.end() || it->second)
+		return;
+
+	if (cb != callbacks_.end())
+	{
+		std::function<void (Response*)> done = cb->second;
+
+		// The tag is free again before the callback gets to send
+		// new requests.
+		callbacks_.erase(cb);
+		pending_.erase(it);
+
+		done(res);
+	}
+	else if (abandoned_.erase(res->tag()))
+		pending_.erase(it);
+	else
+	{
+		it->second = new Response();
+		it->second->Swap(res);
+	}
 }
 
 void
@@ -217,42 +1278,43 @@ Conn::SetTimeout(int timeout)
 	timeout_ = timeout;
 }
 
-Error*
+void
+Conn::SetWindow(int window)
+{
+	window_ = window > 0 ? window : 1;
+}
+
+Status
 Conn::Access(QString token)
 {
 	return Access(token.toStdString());
 }
 
-Error*
+Status
 Conn::Access(std::string token)
 {
-	Error* err;
 	Request req;
 	Response res;
+	Status st;
 
 	req.set_verb(Request::ACCESS);
 	req.set_value(token);
 
-	err = send(req);
-	if (err)
-		return err;
+	st = call(&req, &res);
+	if (!st.Ok())
+		return st;
 
-	err = recv(&res);
-	if (err)
-		return err;
-
-	if (!res.has_err_code())
-		return 0;
-
-	if (res.has_err_detail())
-		return new Error(Response_Err_Name(res.err_code()) + ": " +
-				res.err_detail());
-	else
-		return new Error(Response_Err_Name(res.err_code()));
+	return Status(&res);
 }
 
 Error*
 Conn::GetError()
+{
+	return error_.ToError();
+}
+
+Status
+Conn::GetStatus()
 {
 	return error_;
 }
@@ -263,4 +1325,10 @@ Conn::IsValid()
 	return valid_;
 }
 
+bool
+Conn::IsConnected()
+{
+	return conn_ && !authing_ && conn_->IsOpen();
+}
+
 }  // namespace doozer
@@ -0,0 +1,317 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+#include <QtCore/QString>
+#include <gtest/gtest.h>
+
+#include "doozer.h"
+#include "fakeserver.h"
+
+namespace doozer {
+namespace {
+
+ref::Response
+answer(const ref::Request& req, const std::string& value)
+{
+	ref::Response res;
+
+	res.set_tag(req.tag());
+	res.set_rev(1);
+	res.set_value(value);
+	return res;
+}
+
+// Polls "conn" until "n" of the requests sent have been taken from "srv".
+bool
+take(Conn* conn, FakeServer* srv, std::vector<ref::Request>* reqs, size_t n)
+{
+	for (int i = 0; reqs->size() < n && i < 100; i++)
+	{
+		ref::Request req;
+
+		if (srv->Take(&req, 20))
+			reqs->push_back(req);
+		else
+			conn->Poll(0);
+	}
+
+	return reqs->size() == n;
+}
+
+TEST(ConnTest, ResponsesAreMatchedByTag)
+{
+	FakeServer srv;
+	Conn conn(srv.Uri(), std::string());
+	std::vector<std::string> got;
+	std::vector<ref::Request> reqs;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+
+	for (std::string path : { "/a", "/b", "/c" })
+		ASSERT_TRUE(conn.GetAsync(path, 0, [&got, path](Status st,
+				const std::string& body, int64_t) {
+			EXPECT_TRUE(st.Ok()) << st.ToString();
+			got.push_back(path + "=" + body);
+		}).Ok());
+
+	ASSERT_TRUE(take(&conn, &srv, &reqs, 3));
+
+	// The server is free to answer in any order.
+	for (int i = 2; i >= 0; i--)
+		srv.Reply(answer(reqs[i], reqs[i].path()));
+
+	for (int i = 0; got.size() < 3 && i < 100; i++)
+		ASSERT_TRUE(conn.Poll(20).Ok());
+
+	EXPECT_EQ((std::vector<std::string> { "/c=/c", "/b=/b", "/a=/a" }),
+			got);
+}
+
+TEST(ConnTest, TimedOutCallIsAbandoned)
+{
+	FakeServer srv([](FakeServer* srv, const ref::Request& req) -> bool {
+		if (req.verb() != ref::Request::REV)
+			return false;
+
+		ref::Response res;
+		res.set_tag(req.tag());
+		res.set_rev(7);
+		srv->Reply(res);
+		return true;
+	});
+	Conn conn(srv.Uri(), std::string());
+	std::vector<ref::Request> reqs;
+	std::string body;
+	bool done = false;
+	int64_t rev = 0;
+	Status st;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+	conn.SetTimeout(100);
+
+	st = conn.Get("/slow", 0, &body, 0);
+	EXPECT_EQ(Status::TIMEOUT, st.ErrorCode()) << st.ToString();
+	ASSERT_TRUE(take(&conn, &srv, &reqs, 1));
+
+	// The server still thinks of the tag as being in use, so it isn't
+	// handed out again.
+	ASSERT_TRUE(conn.NopAsync([&done](Status st) {
+		EXPECT_TRUE(st.Ok()) << st.ToString();
+		done = true;
+	}).Ok());
+	ASSERT_TRUE(take(&conn, &srv, &reqs, 2));
+	EXPECT_NE(reqs[0].tag(), reqs[1].tag());
+
+	// The late answer is dropped, rather than passed to whoever asks
+	// next.
+	srv.Reply(answer(reqs[0], "stale"));
+	srv.Reply(answer(reqs[1], ""));
+
+	for (int i = 0; !done && i < 100; i++)
+		ASSERT_TRUE(conn.Poll(20).Ok());
+
+	EXPECT_TRUE(done);
+	ASSERT_TRUE(conn.Rev(&rev).Ok());
+	EXPECT_EQ(7, rev);
+}
+
+TEST(ConnTest, GetdirinfoKeepsToWindow)
+{
+	FakeServer srv([](FakeServer* srv, const ref::Request& req) -> bool {
+		ref::Response res;
+
+		// The STATs are left to the test.
+		if (req.verb() != ref::Request::GETDIR)
+			return false;
+
+		res.set_tag(req.tag());
+		if (req.offset() < 5)
+			res.set_path(std::string(1, 'a' + req.offset()));
+		else
+			res.set_err_code(ref::Response::RANGE);
+		srv->Reply(res);
+		return true;
+	});
+	Conn conn(srv.Uri(), std::string());
+	std::deque<ref::Request> held;
+	std::vector<FileInfo> info;
+	ref::Request req;
+	Status st;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+	conn.SetWindow(2);
+
+	std::thread t([&conn, &info, &st] {
+		st = conn.Getdirinfo(std::string("/d"), 1, 0, -1, &info);
+	});
+
+	for (int n = 0; n < 5; n++)
+	{
+		ref::Response res;
+
+		while ((int) held.size() < std::min(2, 5 - n) &&
+				srv.Take(&req, 1000))
+			held.push_back(req);
+
+		// Nothing more is sent until one of them is answered.
+		EXPECT_FALSE(srv.Take(&req, 20));
+		if (held.empty())
+			break;
+
+		EXPECT_EQ("/d/" + std::string(1, 'a' + n), held.front().path());
+		res.set_tag(held.front().tag());
+		res.set_len(n);
+		res.set_rev(n + 1);
+		srv.Reply(res);
+		held.pop_front();
+	}
+
+	t.join();
+	ASSERT_TRUE(st.Ok()) << st.ToString();
+	ASSERT_EQ(5, (int) info.size());
+
+	for (int n = 0; n < 5; n++)
+	{
+		EXPECT_TRUE(info[n].IsSet());
+		EXPECT_EQ(n, info[n].Len());
+	}
+}
+
+TEST(ConnTest, WaitingForResponseRunsCallbacks)
+{
+	int32_t revtag = 0;
+	FakeServer srv([&revtag](FakeServer* srv, const ref::Request& req)
+			-> bool {
+		// Answer the REV only once the GET came in, right before it.
+		if (req.verb() == ref::Request::REV)
+		{
+			revtag = req.tag();
+			return true;
+		}
+
+		ref::Response res;
+		res.set_tag(revtag);
+		res.set_rev(42);
+		srv->Reply(res);
+
+		srv->Reply(answer(req, "body"));
+		return true;
+	});
+	Conn conn(srv.Uri(), std::string());
+	std::string body;
+	int64_t rev = 0;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+	ASSERT_TRUE(conn.RevAsync([&rev](Status st, int64_t r) {
+		EXPECT_TRUE(st.Ok()) << st.ToString();
+		rev = r;
+	}).Ok());
+
+	// The answer to the REV is in the way of the one to the GET.
+	ASSERT_TRUE(conn.Get("/a", 0, &body, 0).Ok());
+	EXPECT_EQ("body", body);
+	EXPECT_EQ(42, rev);
+}
+
+TEST(ConnTest, LostConnectionFailsOutstandingCalls)
+{
+	FakeServer srv;
+	Conn conn(srv.Uri(), std::string());
+	std::vector<ref::Request> reqs;
+	Status st, got;
+	bool done = false;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+	ASSERT_TRUE(conn.NopAsync([&done, &got](Status s) {
+		got = s;
+		done = true;
+	}).Ok());
+	ASSERT_TRUE(take(&conn, &srv, &reqs, 1));
+
+	srv.Hangup();
+	for (int i = 0; st.Ok() && i < 100; i++)
+		st = conn.Poll(20);
+
+	EXPECT_FALSE(st.Ok());
+	EXPECT_FALSE(done);
+
+	// Nothing is answered on the old connection any more.
+	ASSERT_TRUE(conn.Reconnect().Ok());
+	EXPECT_TRUE(done);
+	EXPECT_FALSE(got.Ok());
+
+	ASSERT_TRUE(conn.NopAsync([](Status) {}).Ok());
+	ASSERT_TRUE(take(&conn, &srv, &reqs, 2));
+	EXPECT_EQ(2, srv.Connections());
+}
+
+TEST(ConnTest, CancelledCallbackIsNotCalled)
+{
+	FakeServer srv;
+	Conn conn(srv.Uri(), std::string());
+	std::vector<ref::Request> reqs;
+	bool waited = false;
+	bool done = false;
+	int32_t tag;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+	ASSERT_TRUE(conn.WaitAsync(std::string("/**"), 1,
+			[&waited](Status, Event*) {
+		waited = true;
+	}, &tag).Ok());
+	ASSERT_TRUE(conn.NopAsync([&done](Status) { done = true; }).Ok());
+	ASSERT_TRUE(take(&conn, &srv, &reqs, 2));
+
+	conn.Cancel(tag);
+	EXPECT_EQ(tag, reqs[0].tag());
+
+	ref::Response ev = answer(reqs[0], "x");
+	ev.set_path("/x");
+	ev.set_flags(4);
+	srv.Reply(ev);
+	srv.Reply(answer(reqs[1], ""));
+
+	for (int i = 0; !done && i < 100; i++)
+		ASSERT_TRUE(conn.Poll(20).Ok());
+
+	EXPECT_TRUE(done);
+	EXPECT_FALSE(waited);
+}
+
+}  // namespace
+}  // namespace doozer
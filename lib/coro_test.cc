@@ -0,0 +1,167 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <QtCore/QString>
+#include <gtest/gtest.h>
+
+#include "doozer.h"
+#include "doozer_coro.h"
+
+namespace doozer {
+namespace {
+
+// A server which lets clients connect but never answers, so requests stay
+// outstanding until the connection is dropped.
+class SilentServer {
+public:
+	SilentServer()
+	{
+		struct sockaddr_in sin;
+		socklen_t len = sizeof(sin);
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		fd_ = socket(AF_INET, SOCK_STREAM, 0);
+		bind(fd_, (struct sockaddr*) &sin, sizeof(sin));
+		listen(fd_, 16);
+		getsockname(fd_, (struct sockaddr*) &sin, &len);
+		port_ = ntohs(sin.sin_port);
+	}
+
+	~SilentServer()
+	{
+		close(fd_);
+	}
+
+	std::string Uri()
+	{
+		return "doozer:?ca=127.0.0.1:" + std::to_string(port_);
+	}
+
+private:
+	int fd_;
+	int port_;
+};
+
+struct Results {
+	int resumed = 0;
+	std::vector<Status> status;
+};
+
+template<typename R>
+Task
+await(Op<R> op, Results* res)
+{
+	R r = co_await op;
+
+	res->resumed++;
+	res->status.push_back(r.status);
+}
+
+TEST(CoConnTest, ResumesEveryOperationWithItsResult)
+{
+	SilentServer server;
+	Conn conn(server.Uri(), std::string());
+	CoConn c(&conn);
+	Results res;
+	int64_t rev = 1;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+
+	c.Spawn(await(c.Set("/a", -1, "b"), &res));
+	c.Spawn(await(c.Del("/a", -1), &res));
+	c.Spawn(await(c.Get("/a", &rev), &res));
+	c.Spawn(await(c.Stat("/a", &rev), &res));
+	c.Spawn(await(c.Rev(), &res));
+	c.Spawn(await(c.Getdir("/", rev), &res));
+	c.Spawn(await(c.Wait("/**", rev), &res));
+	EXPECT_EQ(0, res.resumed);
+
+	// Losing the connection answers all of them.
+	conn.Reconnect();
+	EXPECT_EQ(7, res.resumed);
+	for (const Status& st : res.status)
+		EXPECT_FALSE(st.Ok());
+
+	EXPECT_TRUE(c.Run().Ok());
+}
+
+TEST(CoConnTest, DestroyedTaskIsNotResumed)
+{
+	SilentServer server;
+	Conn conn(server.Uri(), std::string());
+	Results res;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+
+	{
+		CoConn c(&conn);
+
+		c.Spawn(await(c.Get("/a"), &res));
+		c.Spawn(await(c.Wait("/**", 1), &res));
+	}
+
+	// The frames are gone; the callback of the GET must not touch
+	// them, and the WAIT must have been cancelled.
+	conn.Reconnect();
+	EXPECT_EQ(0, res.resumed);
+}
+
+TEST(CoConnTest, FailedSendDoesNotSuspend)
+{
+	Conn conn(std::string("doozer:?ca=127.0.0.1:1"), std::string(),
+			CONNECT_LAZY);
+	CoConn c(&conn);
+	Results res;
+
+	// Nothing listens there, so the request fails before or while
+	// connecting, and the task goes on either way.
+	c.Spawn(await(c.Rev(), &res));
+	c.Run();
+	EXPECT_EQ(1, res.resumed);
+	ASSERT_EQ(1, (int) res.status.size());
+	EXPECT_FALSE(res.status[0].Ok());
+}
+
+}  // namespace
+}  // namespace doozer
@@ -33,14 +33,16 @@
 
 #include <arpa/inet.h>
 
+#include <deque>
 #include <string>
+#include <vector>
 #include <QtCore/QString>
 #include <QtCore/QVector>
 
 #include <libgen.h>
 #include <string.h>
 
-#include "msg.pb.h"
+#include "msg.h"
 #include "doozer.h"
 
 namespace doozer {
@@ -58,7 +60,8 @@ FileInfo::FileInfo()
 
 FileInfo::FileInfo(QString name, int len, int64_t rev, bool is_set,
 		bool is_dir)
-: name_(name), len_(len), rev_(rev), isset_(is_set), isdir_(is_dir)
+: name_(name.toStdString()), len_(len), rev_(rev), isset_(is_set),
+  isdir_(is_dir)
 {
 }
 
@@ -66,22 +69,28 @@ FileInfo::~FileInfo()
 {
 }
 
-std::string
+const std::string&
 FileInfo::Name()
 {
-	return name_.toStdString();
+	return name_;
 }
 
 QString
 FileInfo::QName()
 {
-	return name_;
+	return QString::fromStdString(name_);
+}
+
+void
+FileInfo::Name(std::string newname)
+{
+	name_.swap(newname);
 }
 
 void
 FileInfo::QName(QString newname)
 {
-	name_ = newname;
+	name_ = newname.toStdString();
 }
 
 int
@@ -132,145 +141,198 @@ FileInfo::IsDir(bool newdir)
 	isdir_ = newdir;
 }
 
-Error*
+Status
 Conn::Getdir(QString dir, int64_t rev, int32_t off, int lim,
 		QVector<QString>* names)
 {
-	Error* err;
-	Request req;
-	Response res;
-
-	req.set_verb(Request::GETDIR);
-	req.set_path(dir.toStdString());
-	req.set_rev(rev);
+	std::vector<std::string> res;
+	Status st = Getdir(dir.toStdString(), rev, off, lim, &res);
 
 	names->clear();
 
-	for (; lim; lim--, off++)
-	{
-		req.set_offset(off);
-
-		err = send(req);
-		if (err)
-			return err;
-
-		err = recv(&res);
-		if (err)
-			return err;
+	for (const std::string& name : res)
+		names->push_back(QString::fromStdString(name));
 
-		if (res.has_err_code())
-		{
-			if (res.has_err_detail())
-				return new Error(
-					Response_Err_Name(res.err_code())
-					+ ": " + res.err_detail());
-			else
-				return new Error(
-					Response_Err_Name(res.err_code()));
-		}
-
-		names->push_back(QString(res.path().c_str()));
-	}
-
-	return 0;
+	return st;
 }
 
-Error*
+Status
 Conn::Getdir(std::string dir, int64_t rev, int32_t off, int lim,
 		std::vector<std::string>* names)
 {
-	QVector<QString> qres;
-	Error* err = Getdir(QString(dir.c_str()), rev, off, lim, &qres);
+	Request req;
 
-	if (err)
-		return err;
+	req.set_verb(Request::GETDIR);
+	req.set_path(dir);
+	req.set_rev(rev);
 
 	names->clear();
 
-	for (QString it : qres)
-		names->push_back(it.toStdString());
-
-	return 0;
+	return fetchRange(&req, off, lim, [names](Response* res) {
+		names->push_back(res->path());
+		return true;
+	});
 }
 
-Error*
-Conn::Statinfo(int64_t rev, std::string path, FileInfo** info)
+Status
+Conn::Statinfo(int64_t rev, QString path, FileInfo** info)
 {
-	return Statinfo(rev, QString(path.c_str()), info);
+	return Statinfo(rev, path.toStdString(), info);
 }
 
-Error*
-Conn::Statinfo(int64_t rev, QString path, FileInfo** info)
+Status
+Conn::Statinfo(int64_t rev, std::string path, FileInfo** info)
 {
-	Error* err;
-	int len, slashpos;
+	Status st;
+	int len;
+	size_t slashpos;
 	int64_t filerev;
-	QString shortname;
+	std::string shortname;
 
-	if (path.endsWith('/'))
-		path = path.left(path.length() - 1);
+	if (!path.empty() && path[path.length() - 1] == '/')
+		path.resize(path.length() - 1);
 
-	slashpos = path.lastIndexOf('/');
-	if (slashpos > 0)
-		shortname = path.right(path.length() - slashpos);
+	slashpos = path.rfind('/');
+	if (slashpos != std::string::npos && slashpos > 0)
+		shortname = path.substr(slashpos);
 	else
 		shortname = path;
 
-	err = Stat(path, &rev, &len, &filerev);
-	if (err)
-		return err;
-
-	*info = new FileInfo(shortname, len, filerev, true,
-			(filerev == DIRECTORY));
-	return 0;
+	st = Stat(path, &rev, &len, &filerev);
+	if (!st.Ok())
+		return st;
+
+	*info = new FileInfo();
+	(*info)->Name(shortname);
+	(*info)->Len(len);
+	(*info)->Rev(filerev);
+	(*info)->IsSet(true);
+	(*info)->IsDir(filerev == DIRECTORY);
+	return Status();
 }
 
-Error*
+Status
 Conn::Getdirinfo(QString dir, int64_t rev, int32_t off, int lim,
 		QVector<FileInfo>* info)
 {
-	QVector<QString> names;
-	Error* err = Getdir(dir, rev, off, lim, &names);
+	std::vector<FileInfo> res;
+	Status st = Getdirinfo(dir.toStdString(), rev, off, lim, &res);
+
+	if (!st.Ok())
+		return st;
 
-	if (err)
-		return err;
+	info->clear();
+	info->reserve(res.size());
+
+	for (const FileInfo& it : res)
+		info->push_back(it);
 
-	if (!dir.endsWith('/'))
+	return Status();
+}
+
+Status
+Conn::Getdirinfo(std::string dir, int64_t rev, int32_t off, int lim,
+		std::vector<FileInfo>* info)
+{
+	std::vector<std::string> names;
+	std::deque<std::pair<size_t, int32_t> > inflight;
+	Status st = Getdir(dir, rev, off, lim, &names);
+	Request req;
+	Response res;
+	std::string path;
+	size_t i, sent = 0;
+	int32_t tag;
+
+	if (!st.Ok())
+		return st;
+
+	if (dir.empty() || dir[dir.length() - 1] != '/')
 		dir += "/";
 
 	info->clear();
+	info->resize(names.size());
+
+	for (i = 0; i < names.size(); i++)
+		(*info)[i].Name(names[i]);
 
-	for (QString name : names)
+	// Keep a window of STAT requests in flight, and collect the responses
+	// into their slots.
+	req.set_verb(Request::STAT);
+	req.set_rev(rev);
+
+	for (;;)
 	{
-		FileInfo* fp = 0;
+		while (st.Ok() && sent < names.size() &&
+				(int) inflight.size() < window_)
+		{
+			path.assign(dir);
+			path.append(names[sent]);
+			req.set_path(path);
+
+			st = send(&req, &tag);
+			if (!st.Ok())
+				abandon(tag);
+			else
+				inflight.push_back(std::make_pair(sent++, tag));
+		}
+
+		if (inflight.empty())
+			break;
+
+		i = inflight.front().first;
+		tag = inflight.front().second;
+		inflight.pop_front();
 
-		err = Statinfo(rev, dir + name, &fp);
-		if (err && !fp)
-			fp = new FileInfo(name, 0, 0, false, false);
-		info->push_back(*fp);
-		delete fp;
+		if (!st.Ok())
+		{
+			abandon(tag);
+			continue;
+		}
+
+		st = recv(tag, &res);
+		if (!st.Ok())
+		{
+			abandon(tag);
+			continue;
+		}
+
+		// Entries which can't be stat'ed are left marked as not set.
+		if (res.has_err_code())
+			continue;
+
+		FileInfo& fi = (*info)[i];
+		fi.Len(res.len());
+		fi.Rev(res.rev());
+		fi.IsSet(true);
+		fi.IsDir(res.rev() == DIRECTORY);
 	}
 
-	return 0;
+	return st;
 }
 
-Error*
-Conn::Getdirinfo(std::string dir, int64_t rev, int32_t off, int lim,
-		std::vector<FileInfo>* info)
+Status
+Conn::Walk(QString glob, int64_t rev, int32_t off, int lim, WalkFunc fn)
 {
-	QVector<FileInfo> qinfo;
-	QString qdir(dir.c_str());
-	Error* err = Getdirinfo(qdir, rev, off, lim, &qinfo);
-
-	if (err)
-		return err;
+	return Walk(glob.toStdString(), rev, off, lim, fn);
+}
 
-	info->clear();
+Status
+Conn::Walk(std::string glob, int64_t rev, int32_t off, int lim, WalkFunc fn)
+{
+	Request req;
+	Event ev;
 
-	for (FileInfo it : qinfo)
-		info->push_back(it);
+	req.set_verb(Request::WALK);
+	req.set_path(glob);
+	req.set_rev(rev);
 
-	return 0;
+	return fetchRange(&req, off, lim, [&ev, &fn](Response* res) {
+		ev.Rev(res->rev());
+		ev.Path(res->path());
+		ev.Body(res->value());
+		ev.Flags(res->flags());
+		return fn(&ev);
+	});
 }
 
 }  // namespace doozer
@@ -33,6 +33,7 @@
 #include <string>
 #include <vector>
 #include <QtCore/QString>
+#include "msg.h"
 #include "doozer.h"
 
 namespace doozer {
@@ -59,4 +60,68 @@ Error::ToQString()
 	return message_;
 }
 
+Status::Status()
+: code_(OK)
+{
+}
+
+Status::Status(Code code, std::string detail)
+: code_(code), detail_(detail)
+{
+}
+
+Status::Status(QString message)
+: code_(LOCAL), detail_(message.toStdString())
+{
+}
+
+Status::Status(Response* res)
+: code_(res->has_err_code() ? Code(res->err_code()) : OK)
+{
+	if (res->has_err_detail())
+		detail_.swap(*res->mutable_err_detail());
+}
+
+bool
+Status::Ok() const
+{
+	return code_ == OK;
+}
+
+Status::Code
+Status::ErrorCode() const
+{
+	return code_;
+}
+
+std::string
+Status::ToString() const
+{
+	if (code_ == OK)
+		return "OK";
+
+	if (code_ < 0)
+		return detail_;
+
+	if (detail_.empty())
+		return Response_Err_Name(Response_Err(code_));
+
+	return Response_Err_Name(Response_Err(code_)) + ": " + detail_;
+}
+
+QString
+Status::ToQString() const
+{
+	return QString(ToString().c_str());
+}
+
+Error*
+Status::ToError() const
+{
+	if (code_ == OK)
+		return 0;
+
+	return new Error(ToQString());
+}
+
 }  // namespace doozer
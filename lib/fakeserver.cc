@@ -0,0 +1,241 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+
+#include "fakeserver.h"
+
+namespace doozer {
+
+FakeServer::FakeServer(Handler fn)
+: fn_(fn), stop_(false), client_(-1), connections_(0)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fd_ = socket(AF_INET, SOCK_STREAM, 0);
+	bind(fd_, (struct sockaddr*) &sin, sizeof(sin));
+	listen(fd_, 16);
+	getsockname(fd_, (struct sockaddr*) &sin, &len);
+	port_ = ntohs(sin.sin_port);
+
+	thread_ = std::thread(&FakeServer::run, this);
+}
+
+FakeServer::~FakeServer()
+{
+	stop_ = true;
+	thread_.join();
+
+	if (client_ >= 0)
+		close(client_);
+
+	close(fd_);
+}
+
+std::string
+FakeServer::Uri()
+{
+	return "doozer:?ca=127.0.0.1:" + std::to_string(port_);
+}
+
+void
+FakeServer::Reply(const ref::Response& res)
+{
+	std::lock_guard<std::recursive_mutex> lock(mu_);
+	std::string out(4, '\0');
+	uint32_t len;
+	size_t off = 0;
+
+	if (client_ < 0)
+		return;
+
+	res.AppendToString(&out);
+	len = htonl(out.length() - 4);
+	memcpy(&out[0], &len, 4);
+
+	while (off < out.length())
+	{
+		ssize_t n = send(client_, out.data() + off,
+				out.length() - off, MSG_NOSIGNAL);
+
+		if (n <= 0)
+			return;
+
+		off += n;
+	}
+}
+
+bool
+FakeServer::Take(ref::Request* req, int timeout)
+{
+	std::unique_lock<std::recursive_mutex> lock(mu_);
+
+	if (!held_cv_.wait_for(lock, std::chrono::milliseconds(timeout),
+				[this] { return !held_.empty(); }))
+		return false;
+
+	req->Swap(&held_.front());
+	held_.pop_front();
+	return true;
+}
+
+void
+FakeServer::Hangup()
+{
+	std::lock_guard<std::recursive_mutex> lock(mu_);
+
+	// The server's thread closes the socket once it has seen the end of
+	// it, so its descriptor can't be reused while being polled.
+	if (client_ >= 0)
+		shutdown(client_, SHUT_RDWR);
+}
+
+int
+FakeServer::Connections()
+{
+	std::lock_guard<std::recursive_mutex> lock(mu_);
+
+	return connections_;
+}
+
+int
+FakeServer::Count(ref::Request::Verb verb)
+{
+	std::lock_guard<std::recursive_mutex> lock(mu_);
+
+	return counts_[verb];
+}
+
+void
+FakeServer::run()
+{
+	while (!stop_)
+	{
+		struct pollfd pfds[2];
+		int n = 1;
+
+		pfds[0].fd = fd_;
+		pfds[0].events = POLLIN;
+		pfds[0].revents = 0;
+
+		if (client_ >= 0)
+		{
+			pfds[1].fd = client_;
+			pfds[1].events = POLLIN;
+			pfds[1].revents = 0;
+			n++;
+		}
+
+		if (poll(pfds, n, 20) <= 0)
+			continue;
+
+		if (pfds[0].revents)
+			accept();
+		else if (n > 1 && pfds[1].revents && !read())
+		{
+			std::lock_guard<std::recursive_mutex> lock(mu_);
+
+			close(client_);
+			client_ = -1;
+		}
+	}
+}
+
+void
+FakeServer::accept()
+{
+	int fd = ::accept(fd_, 0, 0);
+	std::lock_guard<std::recursive_mutex> lock(mu_);
+
+	if (fd < 0)
+		return;
+
+	if (client_ >= 0)
+		close(client_);
+
+	client_ = fd;
+	connections_++;
+	rbuf_.clear();
+}
+
+bool
+FakeServer::read()
+{
+	std::lock_guard<std::recursive_mutex> lock(mu_);
+	char buf[4096];
+	ssize_t n = recv(client_, buf, sizeof(buf), 0);
+	uint32_t len;
+
+	if (n <= 0)
+		return false;
+
+	rbuf_.append(buf, n);
+
+	// Hand every complete frame to the handler.
+	while (rbuf_.length() >= 4)
+	{
+		ref::Request req;
+
+		memcpy(&len, rbuf_.data(), 4);
+		len = ntohl(len);
+		if (rbuf_.length() < 4 + len)
+			break;
+
+		req.ParseFromArray(rbuf_.data() + 4, len);
+		rbuf_.erase(0, 4 + len);
+		counts_[req.verb()]++;
+
+		if (fn_ && fn_(this, req))
+			continue;
+
+		held_.push_back(req);
+		held_cv_.notify_all();
+	}
+
+	return true;
+}
+
+}  // namespace doozer
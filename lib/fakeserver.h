@@ -0,0 +1,109 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DOOZER_LIB_FAKESERVER_H
+#define DOOZER_LIB_FAKESERVER_H 1
+
+// A doozer server for the tests, listening on the loopback interface. It
+// answers nothing by itself: the test decides which requests are answered,
+// with what and in which order, either as they come in from a handler or
+// later on from the test itself. Only one client connection is served at
+// a time, and a new one replaces the previous.
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "msg_ref.pb.h"
+
+namespace doozer {
+
+class FakeServer {
+public:
+	// Called on the server's thread for every request which comes in.
+	// Returns whether the request has been dealt with; the others are
+	// kept for Take().
+	typedef std::function<bool (FakeServer* srv,
+			const ref::Request& req)> Handler;
+
+	explicit FakeServer(Handler fn = Handler());
+	~FakeServer();
+
+	// URI for connecting to the server.
+	std::string Uri();
+
+	// Sends "res" to the current client.
+	void Reply(const ref::Response& res);
+
+	// Waits up to "timeout" milliseconds for a request the handler didn't
+	// deal with and removes the oldest one from the queue.
+	bool Take(ref::Request* req, int timeout = 0);
+
+	// Closes the current client connection, as if the server had gone
+	// away.
+	void Hangup();
+
+	// Number of client connections accepted so far.
+	int Connections();
+
+	// Number of requests received with "verb".
+	int Count(ref::Request::Verb verb);
+
+private:
+	void run();
+	void accept();
+	bool read();
+
+	Handler fn_;
+	int fd_;
+	int port_;
+	std::thread thread_;
+	std::atomic<bool> stop_;
+
+	// Everything below is guarded by "mu_", which is held while the
+	// handler runs.
+	std::recursive_mutex mu_;
+	std::condition_variable_any held_cv_;
+	int client_;
+	int connections_;
+	std::string rbuf_;
+	std::deque<ref::Request> held_;
+	std::map<int, int> counts_;
+};
+
+}  // namespace doozer
+
+#endif /* DOOZER_LIB_FAKESERVER_H */
@@ -0,0 +1,248 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+#include "doozer.h"
+
+// Number of seconds looked up cluster addresses are reused for, unless
+// overridden in the DOOZER_NS_TTL environment variable.
+#define NS_TTL	60
+
+namespace doozer {
+
+namespace {
+
+struct Members {
+	std::vector<std::string> addrs;
+	time_t expires;
+};
+
+// Recently looked up cluster members, by cluster name and boot URI.
+std::mutex ns_lock;
+std::map<std::string, Members> ns_cache;
+
+time_t
+ttl()
+{
+	const char* env = getenv("DOOZER_NS_TTL");
+
+	if (env && *env)
+		return atol(env);
+
+	return NS_TTL;
+}
+
+// Returns the file the members of the cluster "name" as listed by the
+// boot cluster at "buri" are remembered in across processes, or an empty
+// string if there is none. Only used when DOOZER_NS_CACHE names a
+// directory and "name" is safe to use as a file name. Boot URIs are told
+// apart by a FNV-1a hash, since they contain all sorts of characters.
+std::string
+cacheFile(const std::string& name, const std::string& buri)
+{
+	const char* dir = getenv("DOOZER_NS_CACHE");
+	uint64_t hash = 14695981039346656037ULL;
+	char suffix[18];
+
+	if (!dir || !*dir || name.empty() || name[0] == '.')
+		return std::string();
+
+	for (char c : name)
+		if (!isalnum((unsigned char) c) && c != '.' && c != '_' &&
+				c != '-')
+			return std::string();
+
+	for (char c : buri)
+	{
+		hash ^= (unsigned char) c;
+		hash *= 1099511628211ULL;
+	}
+
+	snprintf(suffix, sizeof(suffix), "-%016llx",
+			(unsigned long long) hash);
+	return std::string(dir) + "/" + name + suffix;
+}
+
+// Reads the cluster members from "path", which holds the expiry time on
+// the first line followed by one address per line.
+bool
+readCache(const std::string& path, Members* m)
+{
+	FILE* f = fopen(path.c_str(), "r");
+	char line[1024];
+
+	if (!f)
+		return false;
+
+	m->addrs.clear();
+	if (!fgets(line, sizeof(line), f))
+	{
+		fclose(f);
+		return false;
+	}
+
+	m->expires = atol(line);
+	while (fgets(line, sizeof(line), f))
+	{
+		std::string addr(line);
+
+		while (!addr.empty() && (addr[addr.size() - 1] == '\n' ||
+					addr[addr.size() - 1] == '\r'))
+			addr.resize(addr.size() - 1);
+		if (!addr.empty())
+			m->addrs.push_back(addr);
+	}
+
+	fclose(f);
+	return !m->addrs.empty();
+}
+
+// Writes the cluster members to "path". The file is replaced atomically,
+// so concurrent readers never see a partial list.
+void
+writeCache(const std::string& path, const Members& m)
+{
+	std::string tmp = path + "." + std::to_string((long long) getpid());
+	FILE* f = fopen(tmp.c_str(), "w");
+	bool ok;
+
+	if (!f)
+		return;
+
+	fprintf(f, "%lld\n", (long long) m.expires);
+	for (const std::string& addr : m.addrs)
+		fprintf(f, "%s\n", addr.c_str());
+
+	ok = !ferror(f);
+	if (fclose(f) != 0)
+		ok = false;
+
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+		unlink(tmp.c_str());
+}
+
+}  // namespace
+
+Status
+Conn::lookup(QString name, QString buri, bool fresh, QVector<QString>* addrs,
+		bool* cached)
+{
+	std::string key = name.toStdString() + " " + buri.toStdString();
+	std::string path = cacheFile(name.toStdString(), buri.toStdString());
+	time_t now = time(NULL);
+	Members m;
+	int64_t rev;
+	Status err;
+
+	addrs->clear();
+	*cached = false;
+
+	if (!fresh)
+	{
+		std::lock_guard<std::mutex> l(ns_lock);
+		std::map<std::string, Members>::iterator it =
+			ns_cache.find(key);
+
+		if (it != ns_cache.end() && it->second.expires > now)
+			m = it->second;
+		else if (!path.empty() && readCache(path, &m) &&
+				m.expires > now)
+			ns_cache[key] = m;
+		else
+			m.addrs.clear();
+	}
+
+	if (!m.addrs.empty())
+	{
+		for (const std::string& addr : m.addrs)
+			addrs->append(QString::fromStdString(addr));
+
+		*cached = true;
+		return Status();
+	}
+
+	// The members of a cluster are listed in its boot cluster, under
+	// /ctl/ns/<name>/<id>, one address per file.
+	Conn boot(buri, QString());
+	if (!boot.IsValid())
+		return boot.GetStatus();
+
+	boot.SetTimeout(timeout_);
+	err = boot.Rev(&rev);
+	if (!err.Ok())
+		return err;
+
+	// A single WALK fetches all of them, with the requests pipelined.
+	m.addrs.clear();
+	err = boot.Walk("/ctl/ns/" + name.toStdString() + "/*", rev, 0, -1,
+			[&m](Event* ev) {
+		if (!ev->Body().empty())
+			m.addrs.push_back(ev->Body());
+		return true;
+	});
+	if (!err.Ok())
+		return err;
+
+	if (m.addrs.empty())
+		return Status(QString("No addresses found for cluster ") +
+				name);
+
+	m.expires = now + ttl();
+	{
+		std::lock_guard<std::mutex> l(ns_lock);
+		ns_cache[key] = m;
+	}
+
+	if (!path.empty())
+		writeCache(path, m);
+
+	for (const std::string& addr : m.addrs)
+		addrs->append(QString::fromStdString(addr));
+
+	return Status();
+}
+
+}  // namespace doozer
@@ -0,0 +1,913 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <poll.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+#include <QtCore/QUrl>
+#include <QtCore/QVector>
+
+#include "doozer.h"
+
+namespace doozer {
+
+// Seconds to leave a member alone after its connection failed.
+#define RETRY_INTERVAL	5
+
+// Milliseconds after which the round trip time of a member is measured
+// anew if no reads were sent there.
+#define PROBE_INTERVAL	1000
+
+// The answers to those NOPs, and late answers to hedged reads, are picked
+// up by later reads without waiting for them. It's only known when such an
+// answer came in if it was found at most this many milliseconds after the
+// last look which didn't find it.
+#define PROBE_SLACK	50
+
+// Weight of a new sample in the moving average of the round trip time.
+#define RTT_WEIGHT	0.25
+
+// Number of recent read latencies the hedging delay is taken from, and
+// how many of them are needed before reads are hedged at all.
+#define LATENCY_SAMPLES	128
+#define LATENCY_MIN	16
+
+typedef std::chrono::steady_clock Clock;
+
+// Milliseconds since "start".
+static double
+since(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - start)
+		.count();
+}
+
+struct Pool::Member {
+	Member(QString u)
+	: uri(u), conn(new Conn(u, QString(), CONNECT_LAZY)), healthy(false),
+	  connecting(false), retry(0), rtt(0), probing(false), outstanding(0)
+	{
+	}
+
+	~Member()
+	{
+		delete conn;
+	}
+
+	// Starts connecting to the member, or reconnecting if "again" is
+	// set, without waiting for the connection to come up.
+	void dial(bool again)
+	{
+		if (again)
+			conn->ReconnectAsync();
+		else
+			conn->Prewarm();
+
+		healthy = false;
+		connecting = true;
+		dialed = Clock::now();
+	}
+
+	// Takes whatever progress connecting has made, without waiting. Once
+	// the connection is up the member is healthy, and if it fails or
+	// doesn't come up within "timeout" milliseconds, the error is
+	// returned and the member left alone for a while.
+	Status progress(int timeout)
+	{
+		Status st = conn->Poll(0);
+
+		if (st.Ok() && conn->IsConnected())
+		{
+			// Measure the member right away.
+			healthy = true;
+			connecting = false;
+			rtt = 0;
+			sampled = Clock::time_point();
+			return st;
+		}
+
+		if (st.Ok() && (timeout < 0 || Clock::now() - dialed <
+					std::chrono::milliseconds(timeout)))
+			return st;
+
+		if (st.Ok())
+			st = Status(Status::TIMEOUT, "Timed out connecting");
+
+		connecting = false;
+		retry = time(0) + RETRY_INTERVAL;
+		return st;
+	}
+
+	// Runs the callbacks of the answers which have arrived, without
+	// waiting, and notes the time if some are still to come.
+	Status poll()
+	{
+		Status st = conn->Poll(0);
+
+		if (st.Ok() && (probing || outstanding > 0))
+			looked = Clock::now();
+
+		return st;
+	}
+
+	// Whether an answer which just turned up was found soon enough after
+	// the last look which didn't find it to tell when it came in.
+	// Otherwise, all that's known is that it came in after that look.
+	bool timely()
+	{
+		return Clock::now() - looked <=
+			std::chrono::milliseconds(PROBE_SLACK);
+	}
+
+	// Adds a round trip which took from "start" until "end" to the
+	// average, and returns its duration in milliseconds.
+	double sample(Clock::time_point start,
+			Clock::time_point end = Clock::now())
+	{
+		double ms;
+
+		sampled = Clock::now();
+		ms = std::chrono::duration<double, std::milli>(end - start)
+			.count();
+
+		if (rtt > 0)
+			rtt += RTT_WEIGHT * (ms - rtt);
+		else
+			rtt = ms;
+
+		return ms;
+	}
+
+	// How long a request to the member is expected to take. Members we
+	// haven't heard from yet come first, while one which has kept us
+	// waiting for longer than its average counts as at least that slow.
+	double cost()
+	{
+		if (outstanding == 0)
+			return rtt;
+
+		return std::max(rtt, std::chrono::duration<double,
+				std::milli>(Clock::now() - waiting).count());
+	}
+
+	// URI naming just this member.
+	QString uri;
+	Conn* conn;
+	bool healthy;
+
+	// Whether the connection is being established, and since when.
+	bool connecting;
+	Clock::time_point dialed;
+
+	// When to try reconnecting to an unhealthy member.
+	time_t retry;
+
+	// Moving average of the round trip time in milliseconds, or 0 if
+	// unknown, and when it was last updated.
+	double rtt;
+	Clock::time_point sampled;
+
+	// Whether a NOP is on its way, and the number of hedged reads sent
+	// there whose answers are still to come.
+	bool probing;
+	int outstanding;
+
+	// Since when some of those have been outstanding, and when we last
+	// looked for their answers in vain.
+	Clock::time_point waiting;
+	Clock::time_point looked;
+};
+
+Pool::Pool(std::string uri, int size)
+{
+	init(QString(uri.c_str()), size);
+}
+
+Pool::Pool(QString uri, int size)
+{
+	init(uri, size);
+}
+
+Pool::~Pool()
+{
+	for (Member* m : members_)
+		delete m;
+}
+
+void
+Pool::init(QString uri, int size)
+{
+	QStringList addrs;
+	QString secret;
+	QUrl p;
+
+	timeout_ = 30000;
+	hedging_ = 0;
+
+	if (!uri.startsWith(doozer_uri_prefix))
+	{
+		error_ = Status(QString("Invalid URI (wrong prefix)"));
+		return;
+	}
+
+	p.setEncodedQuery(uri.mid(sizeof(DOOZER_URI_PREFIX)-1).toUtf8());
+
+	addrs = p.allQueryItemValues("ca");
+	if (addrs.isEmpty())
+	{
+		error_ = Status(QString("Invalid URI (no addresses)"));
+		return;
+	}
+
+	secret = p.queryItemValue("sk");
+
+	// Pick the subset at random, so the clients of a cluster are spread
+	// across its members.
+	for (int i = addrs.length() - 1; i > 0; i--)
+		std::swap(addrs[i], addrs[qrand() % (i + 1)]);
+
+	while (size > 0 && addrs.length() > size)
+		addrs.removeAt(addrs.length() - 1);
+
+	for (QString addr : addrs)
+	{
+		QString muri = doozer_uri_prefix + "ca=" + addr;
+		Member* m;
+
+		if (secret.length() > 0)
+			muri += "&sk=" +
+				QString(QUrl::toPercentEncoding(secret));
+
+		m = new Member(muri);
+		m->dial(false);
+		members_.push_back(m);
+	}
+
+	settle();
+}
+
+void
+Pool::settle()
+{
+	for (;;)
+	{
+		std::vector<struct pollfd> fds;
+		bool resolving = false;
+		int wait = -1;
+
+		for (Member* m : members_)
+		{
+			struct pollfd pfd;
+			Status st;
+			int left;
+
+			if (!m->connecting)
+				continue;
+
+			st = m->progress(timeout_);
+			if (!st.Ok())
+				error_ = st;
+
+			if (!m->connecting)
+				continue;
+
+			// Wake up in time to give up on the member.
+			left = std::chrono::duration_cast<
+				std::chrono::milliseconds>(m->dialed +
+				std::chrono::milliseconds(timeout_) -
+				Clock::now()).count() + 1;
+			if (timeout_ >= 0 && (wait < 0 || left < wait))
+				wait = std::max(left, 0);
+
+			// Qt may not have a socket yet while it looks up the
+			// host name.
+			pfd.fd = m->conn->Descriptor();
+			if (pfd.fd < 0)
+			{
+				resolving = true;
+				continue;
+			}
+
+			// Until the connection is up, the socket becomes
+			// writable; after that we wait for the answer to the
+			// ACCESS.
+			pfd.events = m->conn->Interest();
+			if (!pfd.events)
+				pfd.events = POLLOUT;
+
+			pfd.revents = 0;
+			fds.push_back(pfd);
+		}
+
+		if (fds.empty() && !resolving)
+			break;
+
+		if (resolving && (wait < 0 || wait > 10))
+			wait = 10;
+
+		poll(fds.empty() ? 0 : &fds[0], fds.size(), wait);
+	}
+}
+
+bool
+Pool::IsValid()
+{
+	return Healthy() > 0;
+}
+
+Status
+Pool::GetStatus()
+{
+	return error_;
+}
+
+int
+Pool::Size()
+{
+	return members_.size();
+}
+
+int
+Pool::Healthy()
+{
+	int n = 0;
+
+	for (Member* m : members_)
+		if (m->healthy)
+			n++;
+
+	return n;
+}
+
+void
+Pool::SetTimeout(int timeout)
+{
+	timeout_ = timeout;
+
+	for (Member* m : members_)
+		m->conn->SetTimeout(timeout);
+}
+
+void
+Pool::SetHedging(double percentile)
+{
+	hedging_ = percentile;
+}
+
+void
+Pool::revive()
+{
+	time_t now = time(0);
+	Clock::time_point start = Clock::now();
+
+	// Members which failed are dialed again in the background; as long
+	// as another one is there, reads don't wait for them.
+	for (Member* m : members_)
+		if (!m->healthy && !m->connecting && m->retry <= now)
+			m->dial(true);
+
+	if (Healthy() == 0)
+		settle();
+
+	for (Member* m : members_)
+	{
+		if (m->connecting)
+		{
+			Status st = m->progress(timeout_);
+
+			if (!st.Ok())
+				error_ = st;
+		}
+
+		if (!m->healthy)
+			continue;
+
+		// Pick up the answers to NOPs, and those to hedged reads which
+		// came in after the read was over.
+		if ((m->probing || m->outstanding > 0) && !m->poll().Ok())
+		{
+			m->healthy = false;
+			m->retry = now + RETRY_INTERVAL;
+			continue;
+		}
+
+		// Reconnecting gives up on reads which are never going to be
+		// answered.
+		if (m->outstanding > 0 && timeout_ >= 0 && start - m->waiting >
+				std::chrono::milliseconds(timeout_))
+		{
+			m->healthy = false;
+			m->retry = now + RETRY_INTERVAL;
+			continue;
+		}
+
+		if (!m->probing && start - m->sampled >
+				std::chrono::milliseconds(PROBE_INTERVAL))
+		{
+			m->probing = true;
+			m->looked = start;
+
+			// An answer found long after the last look is no use
+			// as a sample.
+			if (!m->conn->NopAsync([m, start](Status st) {
+				m->probing = false;
+				if (!st.Ok())
+					return;
+
+				if (m->timely())
+					m->sample(start);
+				else
+					m->sampled = Clock::now();
+			}).Ok())
+			{
+				m->healthy = false;
+				m->retry = now + RETRY_INTERVAL;
+			}
+		}
+	}
+}
+
+Pool::Member*
+Pool::next()
+{
+	Member* best = 0;
+
+	for (Member* m : members_)
+		if (m->healthy && (!best || m->cost() < best->cost()))
+			best = m;
+
+	return best;
+}
+
+Pool::Member*
+Pool::primary()
+{
+	for (Member* m : members_)
+		if (m->healthy)
+			return m;
+
+	return 0;
+}
+
+Status
+Pool::run(std::function<Status (Conn*)> op, bool retry, bool timed,
+		std::deque<double>* latencies)
+{
+	Status st(QString("No cluster member can be reached"));
+	Clock::time_point start;
+	Member* m;
+
+	revive();
+
+	while ((m = retry ? next() : primary()))
+	{
+		start = Clock::now();
+		st = op(m->conn);
+
+		// Errors from the server are as good as any other answer.
+		if (st.ErrorCode() != Status::LOCAL &&
+				st.ErrorCode() != Status::TIMEOUT)
+		{
+			record(latencies, timed ? m->sample(start) :
+					since(start));
+			return st;
+		}
+
+		// A slow member is still there, and a WAIT running out of
+		// time only means nothing happened. The time it took counts
+		// against the member, though. A member we can't even connect
+		// to in time is gone, however.
+		if (st.ErrorCode() == Status::TIMEOUT &&
+				m->conn->IsConnected())
+		{
+			record(latencies, timed ? m->sample(start) :
+					since(start));
+			return st;
+		}
+
+		m->healthy = false;
+		m->retry = time(0) + RETRY_INTERVAL;
+		error_ = st;
+
+		if (!retry)
+			break;
+	}
+
+	return st;
+}
+
+Status
+Pool::hedge(std::function<Status (Conn*, DoneFunc)> op,
+		std::shared_ptr<bool> over, bool timed,
+		std::deque<double>* latencies)
+{
+	Status result(QString("No cluster member can be reached"));
+	Clock::time_point start = Clock::now();
+	int delay = hedgeDelay(*latencies);
+	std::vector<Member*> sent;
+	int failed = 0;
+
+	revive();
+
+	while (!*over)
+	{
+		std::vector<struct pollfd> fds;
+		int wait = -1;
+		int elapsed = std::chrono::duration_cast<
+			std::chrono::milliseconds>(Clock::now() - start)
+			.count();
+
+		// Send the read to the first member right away, to another one
+		// once the delay is up, and to yet another one whenever all
+		// members asked so far have failed.
+		if (sent.empty() || failed == (int) sent.size() ||
+				(sent.size() == 1 && delay >= 0 &&
+				 elapsed >= delay))
+		{
+			Member* m = 0;
+			Clock::time_point at = Clock::now();
+
+			for (Member* c : members_)
+				if (c->healthy && std::find(sent.begin(),
+						sent.end(), c) == sent.end() &&
+						(!m || c->cost() < m->cost()))
+					m = c;
+
+			if (m)
+			{
+				Status st;
+
+				if (m->outstanding++ == 0)
+					m->waiting = at;
+
+				m->looked = at;
+
+				// Answers which come in once the read is over
+				// still count against a slow member.
+				st = op(m->conn, [this, m, at, over, timed,
+						latencies, &result,
+						&failed](Status st) {
+					double ms = since(at);
+
+					m->outstanding--;
+
+					if (st.ErrorCode() == Status::LOCAL)
+					{
+						m->healthy = false;
+						m->retry = time(0) +
+							RETRY_INTERVAL;
+						if (*over)
+							return;
+
+						error_ = result = st;
+						failed++;
+						return;
+					}
+
+					if (timed && m->timely())
+						ms = m->sample(at);
+					else if (timed)
+						ms = m->sample(at, m->looked);
+
+					if (*over)
+						return;
+
+					record(latencies, ms);
+					result = st;
+					*over = true;
+				});
+
+				if (!st.Ok())
+				{
+					m->outstanding--;
+					m->healthy = false;
+					m->retry = time(0) + RETRY_INTERVAL;
+					error_ = result = st;
+					failed++;
+				}
+
+				sent.push_back(m);
+				continue;
+			}
+			else if (failed == (int) sent.size())
+				break;
+
+			// Nobody left to hedge to; just wait for the answer.
+			delay = -1;
+		}
+
+		if (timeout_ >= 0 && elapsed >= timeout_)
+		{
+			result = Status(Status::TIMEOUT, "Timed out waiting "
+					"for response");
+			break;
+		}
+
+		// Run the callbacks of whatever has arrived, then wait for
+		// more on all sockets involved.
+		for (Member* m : sent)
+		{
+			if (!m->healthy || *over)
+				continue;
+
+			if (!m->poll().Ok())
+			{
+				m->healthy = false;
+				m->retry = time(0) + RETRY_INTERVAL;
+				failed++;
+				continue;
+			}
+
+			if (!*over && m->conn->Descriptor() >= 0)
+			{
+				struct pollfd pfd;
+
+				pfd.fd = m->conn->Descriptor();
+				pfd.events = m->conn->Interest();
+				pfd.revents = 0;
+				fds.push_back(pfd);
+			}
+		}
+
+		if (*over || fds.empty())
+			continue;
+
+		if (sent.size() == 1 && delay >= 0)
+			wait = std::max(delay - elapsed, 0);
+		if (timeout_ >= 0 && (wait < 0 || timeout_ - elapsed < wait))
+			wait = std::max(timeout_ - elapsed, 0);
+
+		poll(&fds[0], fds.size(), wait);
+	}
+
+	// Late answers are ignored from here on.
+	*over = true;
+
+	return result;
+}
+
+void
+Pool::record(std::deque<double>* latencies, double ms)
+{
+	if (!latencies)
+		return;
+
+	latencies->push_back(ms);
+
+	if (latencies->size() > LATENCY_SAMPLES)
+		latencies->pop_front();
+}
+
+int
+Pool::hedgeDelay(const std::deque<double>& latencies)
+{
+	std::vector<double> sorted;
+	size_t n;
+
+	if (hedging_ <= 0 || latencies.size() < LATENCY_MIN)
+		return -1;
+
+	sorted.assign(latencies.begin(), latencies.end());
+	n = std::min((size_t) (hedging_ * sorted.size()), sorted.size() - 1);
+	std::nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+
+	return (int) sorted[n] + 1;
+}
+
+Conn*
+Pool::Pick()
+{
+	Member* m;
+
+	revive();
+	m = next();
+
+	return m ? m->conn : 0;
+}
+
+Status
+Pool::Get(QString file, int64_t* storerev, QByteArray* buf, int64_t* filerev)
+{
+	std::string res;
+	Status st = Get(file.toStdString(), storerev, &res, filerev);
+
+	if (st.Ok())
+	{
+		buf->clear();
+		buf->append(res.c_str(), res.length());
+	}
+
+	return st;
+}
+
+Status
+Pool::Get(std::string file, int64_t* storerev, std::string* buf,
+		int64_t* filerev)
+{
+	std::shared_ptr<bool> over;
+
+	if (hedgeDelay(latencies_) < 0)
+		return run([&](Conn* c) {
+			return c->Get(file, storerev, buf, filerev);
+		}, true, true, &latencies_);
+
+	over = std::make_shared<bool>(false);
+	return hedge([=](Conn* c, DoneFunc done) {
+		return c->GetAsync(file, storerev, [=](Status st,
+				const std::string& body, int64_t rev) {
+			if (st.Ok() && !*over)
+			{
+				if (buf)
+					*buf = body;
+
+				if (filerev)
+					*filerev = rev;
+			}
+
+			done(st);
+		});
+	}, over, true, &latencies_);
+}
+
+Status
+Pool::Stat(QString path, int64_t* storerev, int* len, int64_t* filerev)
+{
+	return Stat(path.toStdString(), storerev, len, filerev);
+}
+
+Status
+Pool::Stat(std::string path, int64_t* storerev, int* len, int64_t* filerev)
+{
+	std::shared_ptr<bool> over;
+
+	if (hedgeDelay(latencies_) < 0)
+		return run([&](Conn* c) {
+			return c->Stat(path, storerev, len, filerev);
+		}, true, true, &latencies_);
+
+	over = std::make_shared<bool>(false);
+	return hedge([=](Conn* c, DoneFunc done) {
+		return c->StatAsync(path, storerev, [=](Status st, int l,
+				int64_t rev) {
+			if (st.Ok() && !*over)
+			{
+				if (len)
+					*len = l;
+
+				if (filerev)
+					*filerev = rev;
+			}
+
+			done(st);
+		});
+	}, over, true, &latencies_);
+}
+
+Status
+Pool::Rev(int64_t* rev)
+{
+	std::shared_ptr<bool> over;
+
+	if (hedgeDelay(latencies_) < 0)
+		return run([&](Conn* c) {
+			return c->Rev(rev);
+		}, true, true, &latencies_);
+
+	over = std::make_shared<bool>(false);
+	return hedge([=](Conn* c, DoneFunc done) {
+		return c->RevAsync([=](Status st, int64_t r) {
+			if (st.Ok() && !*over)
+				*rev = r;
+
+			done(st);
+		});
+	}, over, true, &latencies_);
+}
+
+Status
+Pool::Getdir(QString dir, int64_t rev, int32_t off, int lim,
+		QVector<QString>* names)
+{
+	std::vector<std::string> res;
+	Status st = Getdir(dir.toStdString(), rev, off, lim, &res);
+
+	if (!st.Ok())
+		return st;
+
+	names->clear();
+
+	for (const std::string& name : res)
+		names->push_back(QString(name.c_str()));
+
+	return Status();
+}
+
+Status
+Pool::Getdir(std::string dir, int64_t rev, int32_t off, int lim,
+		std::vector<std::string>* names)
+{
+	std::shared_ptr<bool> over;
+
+	if (hedgeDelay(dirLatencies_) < 0)
+		return run([&](Conn* c) {
+			return c->Getdir(dir, rev, off, lim, names);
+		}, true, false, &dirLatencies_);
+
+	over = std::make_shared<bool>(false);
+	return hedge([=](Conn* c, DoneFunc done) {
+		return c->GetdirAsync(dir, rev, off, lim, [=](Status st,
+				const std::vector<std::string>& res) {
+			if (st.Ok() && !*over)
+				*names = res;
+
+			done(st);
+		});
+	}, over, false, &dirLatencies_);
+}
+
+Status
+Pool::Wait(QString glob, int64_t rev, Event* ev)
+{
+	return run([&](Conn* c) {
+		return c->Wait(glob, rev, ev);
+	}, true, false);
+}
+
+Status
+Pool::Wait(std::string glob, int64_t rev, Event* ev)
+{
+	return run([&](Conn* c) {
+		return c->Wait(glob, rev, ev);
+	}, true, false);
+}
+
+Status
+Pool::Set(QString file, int64_t oldRev, int64_t* newRev, QByteArray body)
+{
+	return run([&](Conn* c) {
+		return c->Set(file, oldRev, newRev, body);
+	}, false, false);
+}
+
+Status
+Pool::Set(std::string file, int64_t oldRev, int64_t* newRev,
+		const char *body, size_t len)
+{
+	return run([&](Conn* c) {
+		return c->Set(file, oldRev, newRev, body, len);
+	}, false, false);
+}
+
+Status
+Pool::Del(QString file, int64_t rev)
+{
+	return run([&](Conn* c) {
+		return c->Del(file, rev);
+	}, false, false);
+}
+
+Status
+Pool::Del(std::string file, int64_t rev)
+{
+	return run([&](Conn* c) {
+		return c->Del(file, rev);
+	}, false, false);
+}
+
+}  // namespace doozer
@@ -0,0 +1,392 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <string>
+#include <QtCore/QString>
+#include <QtCore/QTime>
+
+#include "transport.h"
+
+namespace doozer {
+
+PosixTransport::PosixTransport(int sndbuf, int rcvbuf)
+: fd_(-1), state_(CLOSED), sndbuf_(sndbuf), rcvbuf_(rcvbuf), addrs_(0),
+  next_(0)
+{
+}
+
+PosixTransport::~PosixTransport()
+{
+	if (fd_ >= 0)
+		close(fd_);
+
+	if (addrs_)
+		freeaddrinfo(addrs_);
+}
+
+void
+PosixTransport::fail(int err)
+{
+	if (state_ != CLOSED || error_.isEmpty())
+		error_ = err ? QString(strerror(err)) :
+			QString("The remote host closed the connection");
+
+	state_ = CLOSED;
+}
+
+void
+PosixTransport::Connect(const QString& host, int port)
+{
+	struct addrinfo hints;
+	char service[16];
+	std::string name = host.toStdString();
+	int err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	snprintf(service, sizeof(service), "%d", port);
+
+	// Host names are resolved synchronously, unlike with QTcpSocket.
+	err = getaddrinfo(name.c_str(), service, &hints, &addrs_);
+	if (err)
+	{
+		addrs_ = 0;
+		error_ = QString(gai_strerror(err));
+		state_ = CLOSED;
+		return;
+	}
+
+	next_ = addrs_;
+	attempt(0);
+}
+
+void
+PosixTransport::attempt(int err)
+{
+	int one = 1;
+
+	while (next_)
+	{
+		struct addrinfo* ai = next_;
+
+		next_ = ai->ai_next;
+
+		fd_ = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd_ < 0)
+		{
+			err = errno;
+			continue;
+		}
+
+		fcntl(fd_, F_SETFD, FD_CLOEXEC);
+		fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+		setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (sndbuf_ > 0)
+			setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &sndbuf_,
+					sizeof(sndbuf_));
+		if (rcvbuf_ > 0)
+			setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &rcvbuf_,
+					sizeof(rcvbuf_));
+
+		if (connect(fd_, ai->ai_addr, ai->ai_addrlen) == 0)
+		{
+			state_ = CONNECTED;
+			break;
+		}
+
+		// The remaining addresses are kept for Connected() to try
+		// should this one fail after all.
+		if (errno == EINPROGRESS)
+		{
+			state_ = CONNECTING;
+			return;
+		}
+
+		err = errno;
+		close(fd_);
+		fd_ = -1;
+	}
+
+	freeaddrinfo(addrs_);
+	addrs_ = next_ = 0;
+
+	if (fd_ < 0)
+		fail(err);
+}
+
+int
+PosixTransport::Descriptor()
+{
+	return fd_;
+}
+
+bool
+PosixTransport::Connected(bool* failed)
+{
+	struct pollfd pfd;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	*failed = false;
+
+	if (state_ == CONNECTING)
+	{
+		pfd.fd = fd_;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, 0) <= 0)
+			return false;
+
+		if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+			err = errno;
+
+		if (err)
+		{
+			// On to the next address of the host, e.g. IPv4 after
+			// IPv6 was refused.
+			close(fd_);
+			fd_ = -1;
+			attempt(err);
+		}
+		else
+		{
+			state_ = CONNECTED;
+			freeaddrinfo(addrs_);
+			addrs_ = next_ = 0;
+		}
+	}
+
+	*failed = state_ == CLOSED;
+	return state_ == CONNECTED;
+}
+
+bool
+PosixTransport::IsOpen()
+{
+	return state_ == CONNECTED;
+}
+
+size_t
+PosixTransport::Available()
+{
+	int n = 0;
+
+	if (state_ != CONNECTED || ioctl(fd_, FIONREAD, &n) < 0)
+		return 0;
+
+	return n;
+}
+
+bool
+PosixTransport::WaitReadable(int timeout)
+{
+	struct pollfd pfd;
+	int n;
+
+	if (state_ != CONNECTED)
+		return false;
+
+	pfd.fd = fd_;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	do
+		n = poll(&pfd, 1, timeout);
+	while (n < 0 && errno == EINTR);
+
+	return n > 0;
+}
+
+ssize_t
+PosixTransport::Read(char* buf, size_t len)
+{
+	ssize_t n;
+
+	if (state_ != CONNECTED)
+		return -1;
+
+	do
+		n = recv(fd_, buf, len, 0);
+	while (n < 0 && errno == EINTR);
+
+	if (n > 0)
+		return n;
+
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+
+	fail(n < 0 ? errno : 0);
+	return -1;
+}
+
+bool
+PosixTransport::drain()
+{
+	size_t sent = 0;
+
+	while (sent < wbuf_.length())
+	{
+		ssize_t n = send(fd_, wbuf_.data() + sent,
+				wbuf_.length() - sent, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+
+		if (n < 0)
+		{
+			fail(errno);
+			return false;
+		}
+
+		sent += n;
+	}
+
+	wbuf_.erase(0, sent);
+	return true;
+}
+
+bool
+PosixTransport::Write(const char* buf, size_t len)
+{
+	if (state_ != CONNECTED)
+		return false;
+
+	// Only go through the buffer if the socket is backed up already.
+	if (wbuf_.empty())
+	{
+		while (len)
+		{
+			ssize_t n = send(fd_, buf, len, MSG_NOSIGNAL);
+
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+
+			if (n < 0)
+			{
+				fail(errno);
+				return false;
+			}
+
+			buf += n;
+			len -= n;
+		}
+	}
+
+	wbuf_.append(buf, len);
+	return true;
+}
+
+bool
+PosixTransport::Send()
+{
+	return state_ == CONNECTED && drain();
+}
+
+bool
+PosixTransport::Flush(int timeout)
+{
+	QTime started;
+
+	started.start();
+	while (state_ == CONNECTED && drain() && !wbuf_.empty())
+	{
+		struct pollfd pfd;
+		int wait = -1;
+
+		if (timeout >= 0)
+		{
+			wait = timeout - started.elapsed();
+			if (wait <= 0)
+			{
+				error_ = QString("Timed out sending request");
+				return false;
+			}
+		}
+
+		pfd.fd = fd_;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		poll(&pfd, 1, wait);
+	}
+
+	return state_ == CONNECTED && wbuf_.empty();
+}
+
+size_t
+PosixTransport::Pending()
+{
+	return wbuf_.length();
+}
+
+void
+PosixTransport::Close()
+{
+	if (state_ == CONNECTED)
+	{
+		drain();
+		shutdown(fd_, SHUT_RDWR);
+	}
+
+	state_ = CLOSED;
+}
+
+QString
+PosixTransport::Error()
+{
+	return error_;
+}
+
+}  // namespace doozer
@@ -0,0 +1,141 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <QtCore/QString>
+#include <QtNetwork/QTcpSocket>
+
+#include "transport.h"
+
+namespace doozer {
+
+QtTransport::QtTransport()
+: sock_(new QTcpSocket())
+{
+}
+
+QtTransport::~QtTransport()
+{
+	sock_->abort();
+	sock_->deleteLater();
+}
+
+void
+QtTransport::Connect(const QString& host, int port)
+{
+	sock_->connectToHost(host, port);
+}
+
+int
+QtTransport::Descriptor()
+{
+	return sock_->socketDescriptor();
+}
+
+bool
+QtTransport::Connected(bool* failed)
+{
+	*failed = false;
+
+	if (sock_->state() == QAbstractSocket::ConnectedState ||
+			sock_->waitForConnected(0))
+		return true;
+
+	// Qt may still be looking up the host name.
+	*failed = sock_->state() == QAbstractSocket::UnconnectedState;
+	return false;
+}
+
+bool
+QtTransport::IsOpen()
+{
+	return sock_->state() == QAbstractSocket::ConnectedState;
+}
+
+size_t
+QtTransport::Available()
+{
+	return sock_->bytesAvailable();
+}
+
+bool
+QtTransport::WaitReadable(int timeout)
+{
+	return sock_->bytesAvailable() || sock_->waitForReadyRead(timeout);
+}
+
+ssize_t
+QtTransport::Read(char* buf, size_t len)
+{
+	return sock_->read(buf, len);
+}
+
+bool
+QtTransport::Write(const char* buf, size_t len)
+{
+	return sock_->write(buf, len) == (qint64) len;
+}
+
+bool
+QtTransport::Send()
+{
+	// Without an event loop, nothing leaves Qt's buffer unless asked to.
+	sock_->flush();
+	return IsOpen();
+}
+
+bool
+QtTransport::Flush(int timeout)
+{
+	return sock_->waitForBytesWritten(timeout);
+}
+
+size_t
+QtTransport::Pending()
+{
+	return sock_->bytesToWrite();
+}
+
+void
+QtTransport::Close()
+{
+	sock_->disconnectFromHost();
+}
+
+QString
+QtTransport::Error()
+{
+	return sock_->errorString();
+}
+
+}  // namespace doozer
@@ -0,0 +1,653 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <QtCore/QString>
+#include <QtCore/QVector>
+
+#include "doozer.h"
+
+namespace doozer {
+
+typedef std::chrono::steady_clock Clock;
+
+struct SharedConn::Op {
+	std::function<void (Conn*)> fn;
+	Op* next;
+};
+
+// Lets a thread wait for something to happen on the I/O thread.
+struct SharedConn::Done {
+	Done()
+	: done(false)
+	{
+	}
+
+	void Signal()
+	{
+		std::lock_guard<std::mutex> l(lock);
+
+		done = true;
+		cv.notify_all();
+	}
+
+	void Wait()
+	{
+		std::unique_lock<std::mutex> l(lock);
+
+		while (!done)
+			cv.wait(l);
+	}
+
+	std::mutex lock;
+	std::condition_variable cv;
+	bool done;
+};
+
+// A request sent on behalf of a waiting thread, or a NOP checking on a
+// connection.
+struct SharedConn::Call {
+	enum Kind {
+		REQUEST,
+		WAIT,
+		PROBE,
+	};
+
+	Call(Kind k, Conn* c)
+	: kind(k), conn(c), tag(-1), armed(false)
+	{
+	}
+
+	Kind kind;
+	Conn* conn;
+
+	// Tag of a WAIT, for cancelling it.
+	int32_t tag;
+
+	// Called with the result, and cleared once it has been.
+	DoneFunc done;
+
+	// Where the call is in "deadlines_", if it is.
+	bool armed;
+	Deadlines::iterator at;
+};
+
+SharedConn::SharedConn(std::string uri, std::string boot_uri, int size)
+{
+	init(QString(uri.c_str()), QString(boot_uri.c_str()), size);
+}
+
+SharedConn::SharedConn(QString uri, QString boot_uri, int size)
+{
+	init(uri, boot_uri, size);
+}
+
+SharedConn::~SharedConn()
+{
+	char c = 0;
+
+	stop_ = true;
+
+	if (thread_.joinable())
+	{
+		while (write(wake_[1], &c, 1) < 0 && errno == EINTR)
+			;
+
+		thread_.join();
+	}
+
+	for (Op* op = queue_.exchange(0); op; )
+	{
+		Op* next = op->next;
+
+		delete op;
+		op = next;
+	}
+
+	if (wake_[0] >= 0)
+	{
+		close(wake_[0]);
+		close(wake_[1]);
+	}
+}
+
+void
+SharedConn::init(QString uri, QString buri, int size)
+{
+	Done up;
+
+	queue_ = 0;
+	stop_ = false;
+	timeout_ = 30000;
+	turn_ = 0;
+
+	if (pipe(wake_) < 0)
+	{
+		error_ = Status(QString(strerror(errno)));
+		wake_[0] = wake_[1] = -1;
+		return;
+	}
+
+	for (int fd : wake_)
+	{
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+
+	// The connections are made by the I/O thread, so their sockets
+	// belong to it.
+	thread_ = std::thread(&SharedConn::run, this, uri, buri, size, &up);
+	up.Wait();
+}
+
+bool
+SharedConn::IsValid()
+{
+	return error_.Ok();
+}
+
+Status
+SharedConn::GetStatus()
+{
+	return error_;
+}
+
+void
+SharedConn::SetTimeout(int timeout)
+{
+	timeout_ = timeout;
+}
+
+void
+SharedConn::Submit(std::function<void (Conn*)> fn)
+{
+	Op* op;
+	Op* head = queue_.load();
+	char c = 0;
+
+	// Nobody would ever pick it up.
+	if (!thread_.joinable())
+		return;
+
+	op = new Op;
+	op->fn = fn;
+	do
+		op->next = head;
+	while (!queue_.compare_exchange_weak(head, op));
+
+	// Only the first operation of a batch has to wake the I/O thread up,
+	// it picks up all of them at once. A full pipe wakes it up as well.
+	// "op" may already be gone by now.
+	if (!head)
+		while (write(wake_[1], &c, 1) < 0 && errno == EINTR)
+			;
+}
+
+Status
+SharedConn::call(std::function<Status (Conn*, DoneFunc)> op)
+{
+	return request([op](Conn* c, DoneFunc done, int32_t*) {
+		return op(c, done);
+	}, false);
+}
+
+Status
+SharedConn::request(std::function<Status (Conn*, DoneFunc, int32_t*)> op,
+		bool wait)
+{
+	Status result;
+	Done done;
+
+	if (!thread_.joinable())
+		return error_;
+
+	Submit([&](Conn* c) {
+		std::shared_ptr<Call> call(new Call(wait ? Call::WAIT :
+					Call::REQUEST, c));
+		Status st;
+
+		call->done = [&](Status st) {
+			result = st;
+			done.Signal();
+		};
+
+		st = op(c, [this, call](Status st) {
+			finish(call, st);
+		}, &call->tag);
+
+		if (st.Ok())
+			arm(call);
+		else
+			finish(call, st);
+	});
+
+	done.Wait();
+	return result;
+}
+
+void
+SharedConn::arm(std::shared_ptr<Call> call)
+{
+	int timeout = timeout_;
+
+	if (timeout < 0 || !call->done)
+		return;
+
+	call->at = deadlines_.insert(std::make_pair(Clock::now() +
+				std::chrono::milliseconds(std::max(timeout, 1)),
+				call));
+	call->armed = true;
+}
+
+void
+SharedConn::finish(std::shared_ptr<Call> call, Status st)
+{
+	DoneFunc done;
+
+	if (call->armed)
+	{
+		deadlines_.erase(call->at);
+		call->armed = false;
+	}
+
+	done.swap(call->done);
+	if (done)
+		done(st);
+}
+
+int
+SharedConn::expire()
+{
+	Clock::time_point now = Clock::now();
+
+	while (!deadlines_.empty() && deadlines_.begin()->first <= now)
+	{
+		std::shared_ptr<Call> call = deadlines_.begin()->second;
+		DoneFunc done;
+
+		deadlines_.erase(deadlines_.begin());
+		call->armed = false;
+
+		switch (call->kind)
+		{
+		case Call::WAIT:
+			// Nothing happened, which says nothing about the
+			// connection.
+			call->conn->Cancel(call->tag);
+			done.swap(call->done);
+			done(Status(Status::TIMEOUT, "Timed out waiting for "
+						"response"));
+			break;
+
+		case Call::REQUEST:
+			// The response may just be slow; see whether the
+			// connection is still there, and keep waiting.
+			arm(call);
+			probe(call->conn);
+			break;
+
+		case Call::PROBE:
+			// It isn't. This fails all requests sent on it.
+			call->conn->ReconnectAsync();
+			break;
+		}
+	}
+
+	if (deadlines_.empty())
+		return -1;
+
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+			deadlines_.begin()->first - now).count() + 1;
+}
+
+void
+SharedConn::probe(Conn* c)
+{
+	std::shared_ptr<Call> call(new Call(Call::PROBE, c));
+
+	if (probing_.count(c))
+		return;
+
+	call->done = [this, c](Status) {
+		probing_.erase(c);
+	};
+
+	if (!c->NopAsync([this, call](Status st) {
+		finish(call, st);
+	}).Ok())
+	{
+		c->ReconnectAsync();
+		return;
+	}
+
+	probing_.insert(c);
+	arm(call);
+}
+
+void
+SharedConn::run(QString uri, QString buri, int size, Done* up)
+{
+	int timeout = timeout_;
+
+	// Only connecting the first time round blocks; connections lost
+	// later on come up again in the background.
+	for (int i = 0; i < std::max(size, 1); i++)
+	{
+		Conn* c = new Conn(uri, buri);
+
+		if (!c->IsValid())
+			error_ = c->GetStatus();
+
+		c->SetTimeout(timeout);
+		conns_.push_back(c);
+	}
+
+	up->Signal();
+
+	while (!stop_)
+	{
+		std::vector<struct pollfd> fds(1);
+		std::vector<Conn*> polled;
+		char buf[64];
+		int wait = expire();
+
+		fds[0].fd = wake_[0];
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+
+		for (Conn* c : conns_)
+		{
+			struct pollfd pfd;
+
+			if (c->Descriptor() < 0 || !c->Interest())
+				continue;
+
+			pfd.fd = c->Descriptor();
+			pfd.events = c->Interest();
+			pfd.revents = 0;
+			fds.push_back(pfd);
+			polled.push_back(c);
+		}
+
+		if (poll(&fds[0], fds.size(), wait) < 0 && errno != EINTR)
+			break;
+
+		for (size_t n = 1; n < fds.size(); n++)
+		{
+			Conn* c = polled[n - 1];
+
+			if (fds[n].revents && !c->ProcessIO().Ok())
+				c->ReconnectAsync();
+		}
+
+		if (timeout != timeout_)
+		{
+			timeout = timeout_;
+			for (Conn* c : conns_)
+				c->SetTimeout(timeout);
+		}
+
+		// Empty the pipe before looking at the queue, so nothing
+		// submitted afterwards goes unnoticed.
+		if (fds[0].revents)
+			while (read(wake_[0], buf, sizeof(buf)) > 0)
+				;
+
+		drain();
+	}
+
+	for (Conn* c : conns_)
+		delete c;
+
+	conns_.clear();
+	deadlines_.clear();
+}
+
+void
+SharedConn::drain()
+{
+	Op* op = queue_.exchange(0);
+	Op* fifo = 0;
+
+	// The queue holds the most recent operation first.
+	while (op)
+	{
+		Op* next = op->next;
+
+		op->next = fifo;
+		fifo = op;
+		op = next;
+	}
+
+	while (fifo)
+	{
+		Op* next = fifo->next;
+		Conn* c = conns_[turn_++ % conns_.size()];
+
+		// Connections which could not be established again get
+		// another chance with every operation.
+		if (c->Descriptor() < 0)
+			c->ReconnectAsync();
+
+		fifo->fn(c);
+		delete fifo;
+		fifo = next;
+	}
+}
+
+Status
+SharedConn::Get(QString file, int64_t* storerev, QByteArray* buf,
+		int64_t* filerev)
+{
+	std::string res;
+	Status st = Get(file.toStdString(), storerev, &res, filerev);
+
+	if (st.Ok())
+	{
+		buf->clear();
+		buf->append(res.c_str(), res.length());
+	}
+
+	return st;
+}
+
+Status
+SharedConn::Get(std::string file, int64_t* storerev, std::string* buf,
+		int64_t* filerev)
+{
+	return call([&](Conn* c, DoneFunc done) {
+		return c->GetAsync(file, storerev, [=](Status st,
+				const std::string& body, int64_t rev) {
+			if (st.Ok())
+			{
+				if (buf)
+					*buf = body;
+				if (filerev)
+					*filerev = rev;
+			}
+
+			done(st);
+		});
+	});
+}
+
+Status
+SharedConn::Set(QString file, int64_t oldRev, int64_t* newRev,
+		QByteArray body)
+{
+	return Set(file.toStdString(), oldRev, newRev, body.data(),
+			body.length());
+}
+
+Status
+SharedConn::Set(std::string file, int64_t oldRev, int64_t* newRev,
+		const char *body, size_t len)
+{
+	return call([&](Conn* c, DoneFunc done) {
+		return c->SetAsync(file, oldRev, body, len, [=](Status st,
+				int64_t rev) {
+			if (st.Ok() && newRev)
+				*newRev = rev;
+
+			done(st);
+		});
+	});
+}
+
+Status
+SharedConn::Del(QString file, int64_t rev)
+{
+	return Del(file.toStdString(), rev);
+}
+
+Status
+SharedConn::Del(std::string file, int64_t rev)
+{
+	return call([&](Conn* c, DoneFunc done) {
+		return c->DelAsync(file, rev, done);
+	});
+}
+
+Status
+SharedConn::Stat(QString path, int64_t* storerev, int* len,
+		int64_t* filerev)
+{
+	return Stat(path.toStdString(), storerev, len, filerev);
+}
+
+Status
+SharedConn::Stat(std::string path, int64_t* storerev, int* len,
+		int64_t* filerev)
+{
+	return call([&](Conn* c, DoneFunc done) {
+		return c->StatAsync(path, storerev, [=](Status st, int l,
+				int64_t rev) {
+			if (st.Ok())
+			{
+				if (len)
+					*len = l;
+				if (filerev)
+					*filerev = rev;
+			}
+
+			done(st);
+		});
+	});
+}
+
+Status
+SharedConn::Rev(int64_t* rev)
+{
+	return call([&](Conn* c, DoneFunc done) {
+		return c->RevAsync([=](Status st, int64_t r) {
+			if (st.Ok())
+				*rev = r;
+
+			done(st);
+		});
+	});
+}
+
+Status
+SharedConn::Nop()
+{
+	return call([&](Conn* c, DoneFunc done) {
+		return c->NopAsync(done);
+	});
+}
+
+Status
+SharedConn::Getdir(QString dir, int64_t rev, int32_t off, int lim,
+		QVector<QString>* names)
+{
+	std::vector<std::string> res;
+	Status st = Getdir(dir.toStdString(), rev, off, lim, &res);
+
+	if (!st.Ok())
+		return st;
+
+	names->clear();
+
+	for (const std::string& name : res)
+		names->push_back(QString(name.c_str()));
+
+	return Status();
+}
+
+Status
+SharedConn::Getdir(std::string dir, int64_t rev, int32_t off, int lim,
+		std::vector<std::string>* names)
+{
+	return call([&](Conn* c, DoneFunc done) {
+		return c->GetdirAsync(dir, rev, off, lim, [=](Status st,
+				const std::vector<std::string>& res) {
+			if (st.Ok())
+				*names = res;
+
+			done(st);
+		});
+	});
+}
+
+Status
+SharedConn::Wait(QString glob, int64_t rev, Event* ev)
+{
+	return Wait(glob.toStdString(), rev, ev);
+}
+
+Status
+SharedConn::Wait(std::string glob, int64_t rev, Event* ev)
+{
+	return request([&](Conn* c, DoneFunc done, int32_t* tag) {
+		return c->WaitAsync(glob, rev, [=](Status st, Event* e) {
+			if (st.Ok())
+				*ev = *e;
+
+			done(st);
+		}, tag);
+	}, true);
+}
+
+}  // namespace doozer
@@ -0,0 +1,88 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <QtCore/QString>
+
+#include "doozer.h"
+#include "transport.h"
+
+#ifndef DOOZER_DEFAULT_TRANSPORT
+#define DOOZER_DEFAULT_TRANSPORT "qt"
+#endif /* DOOZER_DEFAULT_TRANSPORT */
+
+namespace doozer {
+
+namespace {
+
+TransportKind transport_kind = TRANSPORT_DEFAULT;
+int transport_sndbuf = 0;
+int transport_rcvbuf = 0;
+
+}  // namespace
+
+void
+SetTransport(TransportKind kind, int sndbuf, int rcvbuf)
+{
+	transport_kind = kind;
+	transport_sndbuf = sndbuf;
+	transport_rcvbuf = rcvbuf;
+}
+
+Transport*
+NewTransport()
+{
+	TransportKind kind = transport_kind;
+
+	if (kind == TRANSPORT_DEFAULT)
+	{
+		const char* name = getenv("DOOZER_TRANSPORT");
+
+		if (!name || !*name)
+			name = DOOZER_DEFAULT_TRANSPORT;
+
+		kind = strcmp(name, "posix") ? TRANSPORT_QT : TRANSPORT_POSIX;
+	}
+
+#ifdef DOOZER_QT_TRANSPORT
+	if (kind == TRANSPORT_QT)
+		return new QtTransport();
+#endif /* DOOZER_QT_TRANSPORT */
+
+	return new PosixTransport(transport_sndbuf, transport_rcvbuf);
+}
+
+}  // namespace doozer
@@ -0,0 +1,183 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DOOZER_LIB_TRANSPORT_H
+#define DOOZER_LIB_TRANSPORT_H 1
+
+// Stream connections to a single cluster member, as used by Conn. Besides
+// QTcpSocket, plain non-blocking POSIX sockets can be used, which avoids
+// going through QtNetwork for every request. Libraries configured with
+// --with-transport=posix don't have the QTcpSocket one at all.
+
+#include <sys/types.h>
+#include <string>
+#include <QtCore/QString>
+
+class QTcpSocket;
+struct addrinfo;
+
+namespace doozer {
+
+class Transport {
+public:
+	virtual ~Transport() {}
+
+	// Starts connecting to "host" at "port" without waiting for the
+	// connection to come up.
+	virtual void Connect(const QString& host, int port) = 0;
+
+	// The descriptor of the socket, or -1 if there is none yet.
+	virtual int Descriptor() = 0;
+
+	// Checks without blocking whether the connection has come up. If it
+	// never will, "failed" is set.
+	virtual bool Connected(bool* failed) = 0;
+
+	// Whether the connection is still up.
+	virtual bool IsOpen() = 0;
+
+	// Number of bytes which can be read without blocking.
+	virtual size_t Available() = 0;
+
+	// Waits up to "timeout" milliseconds for something to read. Returns
+	// false if nothing arrived.
+	virtual bool WaitReadable(int timeout) = 0;
+
+	// Reads up to "len" bytes without blocking. Returns -1 if the
+	// connection failed or was closed.
+	virtual ssize_t Read(char* buf, size_t len) = 0;
+
+	// Queues "len" bytes of "buf" for sending, sending what is possible
+	// right away. Returns false if the connection failed.
+	virtual bool Write(const char* buf, size_t len) = 0;
+
+	// Sends as much of the queued data as the socket takes without
+	// blocking. Returns false if the connection failed.
+	virtual bool Send() = 0;
+
+	// Waits up to "timeout" milliseconds for all queued data to be sent.
+	virtual bool Flush(int timeout) = 0;
+
+	// Number of bytes queued which have not been sent yet.
+	virtual size_t Pending() = 0;
+
+	// Closes the connection once all queued data has been sent.
+	virtual void Close() = 0;
+
+	// Describes the last error.
+	virtual QString Error() = 0;
+};
+
+// Creates a transport of the kind selected with SetTransport(), or by the
+// DOOZER_TRANSPORT environment variable ("qt" or "posix").
+Transport* NewTransport();
+
+#ifdef DOOZER_QT_TRANSPORT
+// QTcpSocket based transport.
+class QtTransport : public Transport {
+public:
+	QtTransport();
+	virtual ~QtTransport();
+
+	virtual void Connect(const QString& host, int port);
+	virtual int Descriptor();
+	virtual bool Connected(bool* failed);
+	virtual bool IsOpen();
+	virtual size_t Available();
+	virtual bool WaitReadable(int timeout);
+	virtual ssize_t Read(char* buf, size_t len);
+	virtual bool Write(const char* buf, size_t len);
+	virtual bool Send();
+	virtual bool Flush(int timeout);
+	virtual size_t Pending();
+	virtual void Close();
+	virtual QString Error();
+
+private:
+	QTcpSocket* sock_;
+};
+#endif /* DOOZER_QT_TRANSPORT */
+
+// Transport on a non-blocking socket with TCP_NODELAY set. Send and
+// receive buffer sizes of 0 keep the system defaults.
+class PosixTransport : public Transport {
+public:
+	PosixTransport(int sndbuf, int rcvbuf);
+	virtual ~PosixTransport();
+
+	virtual void Connect(const QString& host, int port);
+	virtual int Descriptor();
+	virtual bool Connected(bool* failed);
+	virtual bool IsOpen();
+	virtual size_t Available();
+	virtual bool WaitReadable(int timeout);
+	virtual ssize_t Read(char* buf, size_t len);
+	virtual bool Write(const char* buf, size_t len);
+	virtual bool Send();
+	virtual bool Flush(int timeout);
+	virtual size_t Pending();
+	virtual void Close();
+	virtual QString Error();
+
+private:
+	enum State {
+		CONNECTING,
+		CONNECTED,
+		CLOSED,
+	};
+
+	// Records "err" as the reason the connection went away.
+	void fail(int err);
+
+	// Starts connecting to the addresses from "next_" in turn, until one
+	// connects or is in progress. If none is left, the connection fails
+	// with "err" unless another error comes up.
+	void attempt(int err);
+
+	// Sends as much of "wbuf_" as the socket takes without blocking.
+	bool drain();
+
+	int fd_;
+	State state_;
+	int sndbuf_;
+	int rcvbuf_;
+	QString error_;
+
+	// Addresses of the host, and the one to try if connecting to the
+	// current one fails, while connecting.
+	struct addrinfo* addrs_;
+	struct addrinfo* next_;
+
+	// Data queued by Write() which the socket did not take yet.
+	std::string wbuf_;
+};
+
+}  // namespace doozer
+
+#endif /* DOOZER_LIB_TRANSPORT_H */
@@ -34,7 +34,7 @@
 #include <string>
 #include <QtCore/QString>
 
-#include "msg.pb.h"
+#include "msg.h"
 #include "doozer.h"
 
 namespace doozer {
@@ -45,7 +45,8 @@ Event::Event()
 }
 
 Event::Event(int64_t rev, QString path, QByteArray body, uint32_t flags)
-: rev_(rev), path_(path), body_(body), flags_(flags)
+: rev_(rev), path_(path.toStdString()), body_(body.data(), body.length()),
+  flags_(flags)
 {
 }
 
@@ -64,37 +65,49 @@ Event::Rev(int64_t newrev)
 QString
 Event::QPath()
 {
-	return path_;
+	return QString::fromStdString(path_);
 }
 
-std::string
+const std::string&
 Event::Path()
 {
-	return path_.toStdString();
+	return path_;
+}
+
+void
+Event::Path(std::string newpath)
+{
+	path_.swap(newpath);
 }
 
 void
 Event::QPath(QString newpath)
 {
-	path_ = newpath;
+	path_ = newpath.toStdString();
 }
 
 QByteArray
 Event::QBody()
 {
-	return body_;
+	return QByteArray(body_.data(), body_.length());
 }
 
-std::string
+const std::string&
 Event::Body()
 {
-	return std::string(body_.data());
+	return body_;
+}
+
+void
+Event::Body(std::string newbody)
+{
+	body_.swap(newbody);
 }
 
 void
 Event::QBody(QByteArray newbody)
 {
-	body_ = newbody;
+	body_.assign(newbody.data(), newbody.length());
 }
 
 uint32_t
@@ -109,46 +122,37 @@ Event::Flags(uint32_t newflags)
 	flags_ = newflags;
 }
 
-Error*
+Status
 Conn::Wait(QString glob, int64_t rev, doozer::Event* ev)
 {
-	Error* err;
+	return Wait(glob.toStdString(), rev, ev);
+}
+
+Status
+Conn::Wait(std::string glob, int64_t rev, doozer::Event* ev)
+{
 	Request req;
 	Response res;
+	Status st;
 
 	req.set_verb(Request::WAIT);
-	req.set_path(glob.toStdString());
+	req.set_path(glob);
 	req.set_rev(rev);
 
-	err = send(req);
-	if (err)
-		return err;
-
-	err = recv(&res);
-	if (err)
-		return err;
+	st = call(&req, &res);
+	if (!st.Ok())
+		return st;
 
 	if (!res.has_err_code())
 	{
 		ev->Rev(res.rev());
-		ev->QPath(QString(res.path().c_str()));
-		ev->QBody(QByteArray(res.value().c_str(),
-					res.value().length()));
+		ev->Path(res.path());
+		ev->Body(res.value());
 		ev->Flags(res.flags());
-		return 0;
+		return Status();
 	}
 
-	if (res.has_err_detail())
-		return new Error(Response_Err_Name(res.err_code()) + ": " +
-				res.err_detail());
-	else
-		return new Error(Response_Err_Name(res.err_code()));
-}
-
-Error*
-Conn::Wait(std::string glob, int64_t rev, doozer::Event* ev)
-{
-	return Wait(QString(glob.c_str()), rev, ev);
+	return Status(&res);
 }
 
 }  // namespace doozer
@@ -0,0 +1,374 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <QtCore/QString>
+
+#include "doozer.h"
+
+namespace doozer {
+
+struct Watcher::Sub {
+	// The watcher this belongs to, or 0 once the subscription has ended
+	// while WAITs were still outstanding.
+	Watcher* watcher;
+	int id;
+	std::string glob;
+	int window;
+	EventsFunc fn;
+
+	// Bumped when the WAITs are sent again after a reconnect, so the
+	// responses to the old ones can be told apart.
+	int gen;
+
+	// All events before "rev" have been delivered. WAITs have been sent
+	// for the revisions up to "sent", "inflight" of which are still
+	// outstanding.
+	int64_t rev;
+	int64_t sent;
+	int inflight;
+
+	// Tags of the outstanding WAITs, by revision.
+	std::map<int64_t, int32_t> tags;
+
+	// Events which can't be delivered yet, by the revision of the WAIT
+	// they were returned for.
+	std::map<int64_t, Event> ready;
+
+	// Events to be passed to "fn" once the responses which have arrived
+	// have all been read, and the error to end the subscription with
+	// after them. "due" is set while the subscription is in the
+	// watcher's list of those to deliver to.
+	std::vector<Event> out;
+	Status err;
+	bool due;
+};
+
+Watcher::Watcher(Conn* conn)
+: conn_(conn), next_id_(1), broken_(false)
+{
+}
+
+Watcher::~Watcher()
+{
+	for (std::pair<const int, std::shared_ptr<Sub> >& it : subs_)
+		cancel(it.second);
+}
+
+Status
+Watcher::Subscribe(QString glob, int64_t rev, EventFunc fn, int* id)
+{
+	return Subscribe(glob.toStdString(), rev, fn, id);
+}
+
+Status
+Watcher::Subscribe(std::string glob, int64_t rev, EventFunc fn, int* id)
+{
+	return SubscribeStream(glob, rev, 1,
+			[fn](Status st, std::vector<Event>* evs) {
+		Event none;
+
+		if (!st.Ok())
+			fn(st, &none);
+
+		for (Event& ev : *evs)
+			fn(st, &ev);
+	}, id);
+}
+
+Status
+Watcher::SubscribeStream(QString glob, int64_t rev, int window,
+		EventsFunc fn, int* id)
+{
+	return SubscribeStream(glob.toStdString(), rev, window, fn, id);
+}
+
+Status
+Watcher::SubscribeStream(std::string glob, int64_t rev, int window,
+		EventsFunc fn, int* id)
+{
+	std::shared_ptr<Sub> sub = std::make_shared<Sub>();
+	Status st;
+
+	sub->watcher = this;
+	sub->id = next_id_++;
+	sub->glob = glob;
+	sub->window = window > 0 ? window : 1;
+	sub->fn = fn;
+	sub->gen = 0;
+	sub->rev = sub->sent = rev;
+	sub->inflight = 0;
+	sub->due = false;
+
+	st = arm(sub);
+	if (!st.Ok())
+	{
+		cancel(sub);
+		return st;
+	}
+
+	subs_[sub->id] = sub;
+
+	if (id)
+		*id = sub->id;
+
+	return Status();
+}
+
+Status
+Watcher::arm(std::shared_ptr<Sub> sub)
+{
+	Status st;
+
+	while (sub->inflight < sub->window)
+	{
+		int64_t rev = sub->sent;
+		int gen = sub->gen;
+
+		int32_t tag;
+
+		st = conn_->WaitAsync(sub->glob, rev,
+				[sub, rev, gen](Status st, Event* ev) {
+			if (sub->gen != gen)
+				return;
+
+			sub->tags.erase(rev);
+			if (sub->watcher)
+				sub->watcher->response(sub, rev, st, ev);
+		}, &tag);
+		if (!st.Ok())
+			return st;
+
+		sub->tags[rev] = tag;
+		sub->sent++;
+		sub->inflight++;
+	}
+
+	return Status();
+}
+
+void
+Watcher::response(std::shared_ptr<Sub> sub, int64_t rev, Status st,
+		Event* ev)
+{
+	std::map<int64_t, Event>::iterator it;
+
+	sub->inflight--;
+
+	// Events before "sub->rev" have been delivered already.
+	if (rev < sub->rev)
+	{
+		if (!arm(sub).Ok())
+			broken_ = true;
+		return;
+	}
+
+	if (st.Ok())
+		sub->ready[rev] = *ev;
+
+	// The WAIT at "sub->rev" tells us the next event, and that there was
+	// nothing before it. Every WAIT up to that event returns it too.
+	while ((it = sub->ready.find(sub->rev)) != sub->ready.end())
+	{
+		sub->out.push_back(it->second);
+		sub->rev = it->second.Rev() + 1;
+		sub->ready.erase(sub->ready.begin(),
+				sub->ready.lower_bound(sub->rev));
+	}
+
+	if (sub->sent < sub->rev)
+		sub->sent = sub->rev;
+
+	// Have the next WAITs on their way while the subscriber is busy. If
+	// they can't be sent, the connection is gone and we'll resume once
+	// we're back.
+	if (st.Ok() && !arm(sub).Ok())
+		broken_ = true;
+
+	if (!st.Ok())
+		sub->err = st;
+
+	// Whatever else has arrived along with this response is passed on
+	// together with it.
+	if ((!sub->out.empty() || !st.Ok()) && !sub->due)
+	{
+		sub->due = true;
+		due_.push_back(sub);
+	}
+}
+
+void
+Watcher::deliver()
+{
+	// Subscribers may read more responses, or subscribe, while we're
+	// calling them.
+	while (!due_.empty())
+	{
+		std::vector<std::shared_ptr<Sub> > due;
+
+		due.swap(due_);
+
+		for (std::shared_ptr<Sub>& sub : due)
+		{
+			std::vector<Event> evs;
+
+			sub->due = false;
+			evs.swap(sub->out);
+
+			if (!sub->watcher)
+				continue;
+
+			if (!evs.empty())
+				sub->fn(Status(), &evs);
+
+			if (!sub->err.Ok() && sub->watcher)
+				end(sub, sub->err);
+		}
+	}
+}
+
+void
+Watcher::end(std::shared_ptr<Sub> sub, Status st)
+{
+	std::vector<Event> none;
+
+	subs_.erase(sub->id);
+	cancel(sub);
+	sub->fn(st, &none);
+}
+
+void
+Watcher::cancel(std::shared_ptr<Sub> sub)
+{
+	// Nobody is interested in the answers to the WAITs which are still
+	// outstanding any more.
+	for (std::pair<const int64_t, int32_t>& it : sub->tags)
+		conn_->Cancel(it.second);
+
+	sub->tags.clear();
+	sub->watcher = 0;
+}
+
+void
+Watcher::Unsubscribe(int id)
+{
+	std::map<int, std::shared_ptr<Sub> >::iterator it = subs_.find(id);
+
+	if (it == subs_.end())
+		return;
+
+	cancel(it->second);
+	subs_.erase(it);
+}
+
+int
+Watcher::Size()
+{
+	return subs_.size();
+}
+
+int64_t
+Watcher::Rev(int id)
+{
+	std::map<int, std::shared_ptr<Sub> >::iterator it = subs_.find(id);
+
+	if (it == subs_.end())
+		return -1;
+
+	return it->second->rev;
+}
+
+Status
+Watcher::resume()
+{
+	Status st;
+
+	// The WAITs which were in flight are failed by the reconnect, but
+	// nothing was lost as long as we start over at the first revision
+	// which hasn't been delivered.
+	for (std::pair<const int, std::shared_ptr<Sub> >& it : subs_)
+	{
+		it.second->gen++;
+		it.second->sent = it.second->rev;
+		it.second->inflight = 0;
+		it.second->tags.clear();
+		it.second->ready.clear();
+	}
+
+	broken_ = false;
+	st = conn_->Reconnect();
+	if (!st.Ok())
+		return st;
+
+	for (std::pair<const int, std::shared_ptr<Sub> >& it : subs_)
+	{
+		st = arm(it.second);
+		if (!st.Ok())
+			return st;
+	}
+
+	return Status();
+}
+
+Status
+Watcher::Poll(int timeout)
+{
+	Status st = conn_->Poll(timeout);
+
+	deliver();
+
+	if (!st.Ok() || broken_)
+		st = resume();
+
+	return st;
+}
+
+Status
+Watcher::Run()
+{
+	Status st;
+
+	while (!subs_.empty())
+	{
+		st = Poll(-1);
+		if (!st.Ok())
+			return st;
+	}
+
+	return Status();
+}
+
+}  // namespace doozer
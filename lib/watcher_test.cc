@@ -0,0 +1,234 @@
+/*-
+ * Copyright (c) 2012 Caoimhe Chaos <caoimhechaos@protonmail.com>,
+ *                    Ancient Solutions. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions  of source code must retain  the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions  in   binary  form  must   reproduce  the  above
+ *    copyright  notice, this  list  of conditions  and the  following
+ *    disclaimer in the  documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS  SOFTWARE IS  PROVIDED BY  ANCIENT SOLUTIONS  AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+ * FOR A  PARTICULAR PURPOSE  ARE DISCLAIMED.  IN  NO EVENT  SHALL THE
+ * FOUNDATION  OR CONTRIBUTORS  BE  LIABLE FOR  ANY DIRECT,  INDIRECT,
+ * INCIDENTAL,   SPECIAL,    EXEMPLARY,   OR   CONSEQUENTIAL   DAMAGES
+ * (INCLUDING, BUT NOT LIMITED  TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE,  DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT  LIABILITY,  OR  TORT  (INCLUDING NEGLIGENCE  OR  OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <string>
+#include <vector>
+#include <QtCore/QString>
+#include <gtest/gtest.h>
+
+#include "doozer.h"
+#include "fakeserver.h"
+
+namespace doozer {
+namespace {
+
+// Answers the WAIT "req" with the change of "path" at revision "rev".
+ref::Response
+event(const ref::Request& req, int64_t rev, const std::string& path)
+{
+	ref::Response res;
+
+	res.set_tag(req.tag());
+	res.set_rev(rev);
+	res.set_path(path);
+	res.set_value("v" + std::to_string(rev));
+	res.set_flags(4);
+	return res;
+}
+
+// Polls "w" until a WAIT has been taken from "srv".
+bool
+take(Watcher* w, FakeServer* srv, ref::Request* req)
+{
+	for (int i = 0; i < 100; i++)
+	{
+		if (srv->Take(req, 20))
+			return true;
+
+		w->Poll(0);
+	}
+
+	return false;
+}
+
+// Polls "w" until "evs" holds "n" events.
+void
+poll(Watcher* w, std::vector<int64_t>* evs, size_t n)
+{
+	for (int i = 0; evs->size() < n && i < 100; i++)
+		ASSERT_TRUE(w->Poll(20).Ok());
+}
+
+TEST(WatcherTest, DeliversEventsInOrder)
+{
+	FakeServer srv;
+	Conn conn(srv.Uri(), std::string());
+	Watcher w(&conn);
+	std::string glob = "/x/*";
+	ref::Request reqs[3];
+	std::vector<int64_t> evs;
+	int batches = 0;
+	int id;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+	ASSERT_TRUE(w.SubscribeStream(glob, 5, 3,
+			[&](Status st, std::vector<Event>* got) {
+		EXPECT_TRUE(st.Ok()) << st.ToString();
+		for (Event& ev : *got)
+			evs.push_back(ev.Rev());
+		batches++;
+	}, &id).Ok());
+
+	for (ref::Request& req : reqs)
+		ASSERT_TRUE(take(&w, &srv, &req));
+
+	EXPECT_EQ(5, reqs[0].rev());
+	EXPECT_EQ(6, reqs[1].rev());
+	EXPECT_EQ(7, reqs[2].rev());
+
+	// Nothing happened at revision 5, so its WAIT returns the event at
+	// 6. Until it's in, the later events are held back.
+	srv.Reply(event(reqs[2], 7, "/x/b"));
+	srv.Reply(event(reqs[1], 6, "/x/a"));
+
+	// Each of them has the next WAIT sent.
+	for (int i = 0; i < 2; i++)
+	{
+		ref::Request next;
+
+		ASSERT_TRUE(take(&w, &srv, &next));
+	}
+
+	EXPECT_TRUE(evs.empty());
+	EXPECT_EQ(5, w.Rev(id));
+
+	srv.Reply(event(reqs[0], 6, "/x/a"));
+	poll(&w, &evs, 2);
+
+	EXPECT_EQ((std::vector<int64_t> { 6, 7 }), evs);
+	EXPECT_EQ(1, batches);
+	EXPECT_EQ(8, w.Rev(id));
+}
+
+TEST(WatcherTest, BatchesEventsArrivingTogether)
+{
+	FakeServer srv;
+	Conn conn(srv.Uri(), std::string());
+	Watcher w(&conn);
+	std::string glob = "/x/*";
+	ref::Request reqs[3];
+	std::vector<int64_t> evs;
+	int batches = 0;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+	ASSERT_TRUE(w.SubscribeStream(glob, 5, 3,
+			[&](Status st, std::vector<Event>* got) {
+		EXPECT_TRUE(st.Ok()) << st.ToString();
+		for (Event& ev : *got)
+			evs.push_back(ev.Rev());
+		batches++;
+	}, 0).Ok());
+
+	for (ref::Request& req : reqs)
+		ASSERT_TRUE(take(&w, &srv, &req));
+
+	// Answered in order, and read in one go.
+	for (int i = 0; i < 3; i++)
+		srv.Reply(event(reqs[i], 5 + i, "/x/a"));
+
+	poll(&w, &evs, 3);
+
+	EXPECT_EQ((std::vector<int64_t> { 5, 6, 7 }), evs);
+	EXPECT_EQ(1, batches);
+}
+
+TEST(WatcherTest, ResumesAfterReconnect)
+{
+	FakeServer srv;
+	Conn conn(srv.Uri(), std::string());
+	Watcher w(&conn);
+	std::string glob = "/x/*";
+	std::vector<int64_t> evs;
+	ref::Request req;
+	int id;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+	ASSERT_TRUE(w.Subscribe(glob, 1, [&evs](Status st, Event* ev) {
+		EXPECT_TRUE(st.Ok()) << st.ToString();
+		evs.push_back(ev->Rev());
+	}, &id).Ok());
+
+	ASSERT_TRUE(take(&w, &srv, &req));
+	EXPECT_EQ(1, req.rev());
+	srv.Reply(event(req, 3, "/x/a"));
+	poll(&w, &evs, 1);
+
+	ASSERT_TRUE(take(&w, &srv, &req));
+	EXPECT_EQ(4, req.rev());
+
+	// The WAIT at 4 is lost along with the connection, and sent again
+	// once the watcher has reconnected.
+	srv.Hangup();
+	ASSERT_TRUE(take(&w, &srv, &req));
+	EXPECT_EQ(2, srv.Connections());
+	EXPECT_EQ(4, req.rev());
+
+	srv.Reply(event(req, 5, "/x/b"));
+	poll(&w, &evs, 2);
+
+	EXPECT_EQ((std::vector<int64_t> { 3, 5 }), evs);
+	EXPECT_EQ(6, w.Rev(id));
+	EXPECT_EQ(1, w.Size());
+}
+
+TEST(WatcherTest, LostHistoryEndsSubscription)
+{
+	FakeServer srv;
+	Conn conn(srv.Uri(), std::string());
+	Watcher w(&conn);
+	std::string glob = "/x/*";
+	std::vector<Status> got;
+	ref::Request req;
+	ref::Response res;
+
+	ASSERT_TRUE(conn.IsValid()) << conn.GetStatus().ToString();
+	ASSERT_TRUE(w.Subscribe(glob, 1, [&got](Status st, Event*) {
+		got.push_back(st);
+	}, 0).Ok());
+	EXPECT_EQ(1, w.Size());
+
+	ASSERT_TRUE(take(&w, &srv, &req));
+	res.set_tag(req.tag());
+	res.set_err_code(ref::Response::TOO_LATE);
+	srv.Reply(res);
+
+	for (int i = 0; got.empty() && i < 100; i++)
+		ASSERT_TRUE(w.Poll(20).Ok());
+
+	ASSERT_EQ(1, (int) got.size());
+	EXPECT_EQ(Status::TOO_LATE, got[0].ErrorCode());
+	EXPECT_EQ(0, w.Size());
+}
+
+}  // namespace
+}  // namespace doozer
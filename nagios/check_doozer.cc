@@ -45,7 +45,7 @@
 #include "doozer.h"
 
 using doozer::Conn;
-using doozer::Error;
+using doozer::Status;
 using std::clock;
 using std::string;
 
@@ -91,26 +91,24 @@ int main(int argc, char** argv)
 		c.reset(new Conn(doozer_uri, doozer_boot_uri));
 	else
 		c.reset(new Conn());
-	Error* err;
+	Status st;
 
 	if (!c->IsValid())
 	{
-		err = c->GetError();
+		st = c->GetStatus();
 		std::cerr << "CRITICAL - Unable to connect to Doozer: "
-			<< err->ToString() << std::endl;
-		delete err;
+			<< st.ToString() << std::endl;
 		return 2;
 	}
 
 	if (timeout)
 		c->SetTimeout(timeout);
 
-	err = c->Nop();
-	if (err)
+	st = c->Nop();
+	if (!st.Ok())
 	{
 		std::cerr << "CRITICAL - Unable to connect to Doozer: "
-			<< err->ToString() << std::endl;
-		delete err;
+			<< st.ToString() << std::endl;
 		return 2;
 	}
 	else